@@ -0,0 +1,136 @@
+# Links Lua scripts into a target as precompiled bytecode.
+#
+#   LUALAO_EMBED_SCRIPTS(<target> <symbol>
+#       [BASE_DIR <dir>]
+#       SCRIPTS <file.lua>...)
+#
+# Every script is compiled with luac at build time (when LUAC_EXECUTABLE
+# is found; otherwise the source text is embedded and compiled on load)
+# and all chunks are packed into one blob with an index sorted by module
+# name. Module names are the paths relative to BASE_DIR (default: the
+# current source dir) without ".lua", with "/" replaced by ".", so
+# scripts/game/rules.lua under BASE_DIR scripts becomes "game.rules".
+#
+# The generated source defines
+#
+#   extern const lualao::embedded_bundle <symbol>;
+#
+# which lualao::install_embedded_searcher() hands to require. luac must
+# match the Lua version and build configuration linked into the target,
+# since bytecode is not portable.
+#
+# This file doubles as the generator script, run with cmake -P.
+
+if(CMAKE_SCRIPT_MODE_FILE)
+    # Script mode: SYMBOL, OUTPUT and ENTRIES ("name=file" pairs joined
+    # with "|") come in as -D definitions
+    STRING(REPLACE "|" ";" ENTRIES "${ENTRIES}")
+
+    # The index is sorted by module name alone, in the byte order
+    # embedded_bundle::find() searches with. Sorting the "name=file"
+    # strings would put "a.b=..." before "a=...".
+    SET(NAMES "")
+    foreach(ENTRY ${ENTRIES})
+        STRING(REGEX REPLACE "=.*$" "" NAME "${ENTRY}")
+        STRING(REGEX REPLACE "^[^=]*=" "" CHUNK_${NAME} "${ENTRY}")
+        LIST(APPEND NAMES "${NAME}")
+    endforeach()
+    LIST(SORT NAMES)
+
+    SET(BLOB "")
+    SET(INDEX "")
+    SET(OFFSET 0)
+    foreach(NAME ${NAMES})
+        SET(CHUNK "${CHUNK_${NAME}}")
+        FILE(READ "${CHUNK}" HEX HEX)
+        STRING(LENGTH "${HEX}" HEX_LENGTH)
+        MATH(EXPR SIZE "${HEX_LENGTH} / 2")
+        STRING(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," BYTES "${HEX}")
+        SET(BLOB "${BLOB}    // ${NAME}\n    ${BYTES}\n")
+        SET(INDEX "${INDEX}    {\"${NAME}\", ${OFFSET}, ${SIZE}},\n")
+        MATH(EXPR OFFSET "${OFFSET} + ${SIZE}")
+    endforeach()
+    LIST(LENGTH NAMES COUNT)
+
+    FILE(WRITE "${OUTPUT}.tmp"
+"// Generated by cmake/embed_scripts.cmake, do not edit.
+#include \"lualao/embedded_scripts.hpp\"
+
+namespace {
+    const unsigned char chunks[] = {
+${BLOB}    0x00
+    };
+
+    const lualao::embedded_script scripts[] = {
+${INDEX}    {nullptr, 0, 0}
+    };
+}
+
+extern const lualao::embedded_bundle ${SYMBOL} = {scripts, ${COUNT}, chunks};
+")
+    # only touch the output when it changed, to avoid needless rebuilds
+    EXECUTE_PROCESS(COMMAND ${CMAKE_COMMAND} -E copy_if_different
+        "${OUTPUT}.tmp" "${OUTPUT}")
+    FILE(REMOVE "${OUTPUT}.tmp")
+    return()
+endif()
+
+INCLUDE(CMakeParseArguments)
+
+SET(LUALAO_EMBED_GENERATOR "${CMAKE_CURRENT_LIST_FILE}")
+FIND_PROGRAM(LUAC_EXECUTABLE NAMES luac5.3 luac53 luac)
+
+function(LUALAO_EMBED_SCRIPTS TARGET SYMBOL)
+    CMAKE_PARSE_ARGUMENTS(EMBED "" "BASE_DIR" "SCRIPTS" ${ARGN})
+    if(NOT EMBED_BASE_DIR)
+        SET(EMBED_BASE_DIR "${CMAKE_CURRENT_SOURCE_DIR}")
+    endif()
+    GET_FILENAME_COMPONENT(EMBED_BASE_DIR "${EMBED_BASE_DIR}" ABSOLUTE)
+
+    SET(OUT_DIR "${CMAKE_CURRENT_BINARY_DIR}/embedded_${SYMBOL}")
+    FILE(MAKE_DIRECTORY "${OUT_DIR}")
+
+    SET(ENTRIES "")
+    SET(CHUNKS "")
+    foreach(SCRIPT ${EMBED_SCRIPTS})
+        GET_FILENAME_COMPONENT(SCRIPT_PATH "${SCRIPT}" ABSOLUTE)
+        FILE(RELATIVE_PATH RELATIVE "${EMBED_BASE_DIR}" "${SCRIPT_PATH}")
+        STRING(REGEX REPLACE "\\.lua$" "" MODULE "${RELATIVE}")
+        STRING(REPLACE "/" "." MODULE "${MODULE}")
+
+        if(LUAC_EXECUTABLE)
+            SET(CHUNK "${OUT_DIR}/${MODULE}.luac")
+            ADD_CUSTOM_COMMAND(OUTPUT "${CHUNK}"
+                COMMAND "${LUAC_EXECUTABLE}" -s -o "${CHUNK}" "${SCRIPT_PATH}"
+                DEPENDS "${SCRIPT_PATH}"
+                COMMENT "Compiling ${RELATIVE} to bytecode"
+                VERBATIM
+            )
+        else()
+            SET(CHUNK "${SCRIPT_PATH}")
+        endif()
+        LIST(APPEND CHUNKS "${CHUNK}")
+        if(ENTRIES)
+            SET(ENTRIES "${ENTRIES}|${MODULE}=${CHUNK}")
+        else()
+            SET(ENTRIES "${MODULE}=${CHUNK}")
+        endif()
+    endforeach()
+
+    if(NOT LUAC_EXECUTABLE)
+        MESSAGE(STATUS "luac not found: ${SYMBOL} embeds Lua source text")
+    endif()
+
+    SET(GENERATED "${OUT_DIR}/${SYMBOL}.cpp")
+    ADD_CUSTOM_COMMAND(OUTPUT "${GENERATED}"
+        COMMAND "${CMAKE_COMMAND}"
+            "-DSYMBOL=${SYMBOL}"
+            "-DOUTPUT=${GENERATED}"
+            "-DENTRIES=${ENTRIES}"
+            -P "${LUALAO_EMBED_GENERATOR}"
+        DEPENDS ${CHUNKS} "${LUALAO_EMBED_GENERATOR}"
+        COMMENT "Embedding Lua scripts as ${SYMBOL}"
+        VERBATIM
+    )
+    TARGET_SOURCES(${TARGET} PRIVATE "${GENERATED}")
+endfunction()
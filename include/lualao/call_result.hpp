@@ -0,0 +1,98 @@
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "lualao/lua_exception.hpp"
+
+namespace lualao {
+
+    // Outcome of a non-throwing call or load (function_reference::try_call,
+    // state::try_load_file, state::try_load_buffer). On success the values
+    // are on the stack as usual; on failure the error object is on top of
+    // the stack and error() views its message, which stays valid for as
+    // long as that value is left there. The message (and any traceback the
+    // default handler captured) is only formatted when error() is called.
+    class call_result {
+      public:
+        static call_result success(int results) {
+            return call_result(LUA_OK, results, std::string_view());
+        }
+
+        static call_result failure(int status, std::string_view message) {
+            return call_result(status, 0, message);
+        }
+
+        // Refers to the error object on top of L's stack.
+        static call_result failure(lua_State *L, int status) {
+            call_result result(status, 0, std::string_view());
+            result.m_state = L;
+            result.m_index = lua_absindex(L, -1);
+            return result;
+        }
+
+        // LUA_OK or the status returned by lua_pcall/lua_load
+        int status() const {
+            return m_status;
+        }
+
+        bool ok() const {
+            return m_status == LUA_OK;
+        }
+
+        explicit operator bool() const {
+            return ok();
+        }
+
+        bool out_of_memory() const {
+            return m_status == LUA_ERRMEM;
+        }
+
+        // Number of values the call left on the stack.
+        int results() const {
+            return m_results;
+        }
+
+        std::string_view error() const {
+            if (m_state != nullptr) {
+                std::size_t len = 0;
+                const char *message = error_message(m_state, m_index, &len);
+                m_error = message ? std::string_view(message, len)
+                                  : "(error object is not a string)";
+                m_state = nullptr;
+            }
+            return m_error;
+        }
+
+        // Turns a failure into the exception the throwing API would raise.
+        void throw_if_error() const {
+            if (m_status == LUA_OK)
+                return;
+            std::string message(error());
+            if (m_status == LUA_ERRMEM)
+                throw lua_memory_error(message);
+            throw lua_exception(message);
+        }
+
+      private:
+        int m_status;
+        int m_results;
+        // set while the message still has to be read from the stack
+        mutable lua_State *m_state;
+        int m_index;
+        mutable std::string_view m_error;
+
+        call_result(int status, int results, std::string_view error)
+            : m_status(status)
+            , m_results(results)
+            , m_state(nullptr)
+            , m_index(0)
+            , m_error(error) {}
+    };
+
+};
@@ -0,0 +1,296 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/state.hpp"
+#include "lualao/value_buffer.hpp"
+#include "lualao/concurrency/backoff.hpp"
+#include "lualao/concurrency/mpmc_queue.hpp"
+#include "lualao/concurrency/spsc_queue.hpp"
+
+namespace lualao {
+
+    // Bounded channel carrying packed Lua values between states that live on
+    // different threads. Values are packed once on send and rebuilt on the
+    // receiving state; the queue itself is lock-free and the blocking calls
+    // wait with a backoff instead of a mutex.
+    //
+    // Closing a channel makes further sends fail; receivers drain whatever
+    // is left and then see the channel as closed.
+    template <typename Queue>
+    class basic_channel {
+      private:
+        Queue m_queue;
+        std::atomic<bool> m_closed;
+
+      public:
+        explicit basic_channel(std::size_t capacity)
+            : m_queue(capacity)
+            , m_closed(false) {}
+
+        bool try_send(value_buffer &&message) {
+            if (is_closed())
+                return false;
+            return m_queue.try_push(std::move(message));
+        }
+
+        // Packs the value at index before trying; nothing is sent when the
+        // channel is full.
+        bool try_send(lua_State *L, int index) {
+            value_buffer message(L, index);
+            return try_send(std::move(message));
+        }
+
+        void send(value_buffer &&message) {
+            if (is_closed())
+                throw lua_exception("send on closed channel");
+            backoff wait;
+            while (!m_queue.try_push(std::move(message))) {
+                if (is_closed())
+                    throw lua_exception("send on closed channel");
+                wait.pause();
+            }
+        }
+
+        void send(lua_State *L, int index) {
+            send(value_buffer(L, index));
+        }
+
+        bool try_receive(value_buffer &out) {
+            return m_queue.try_pop(out);
+        }
+
+        // Pushes the received value onto L when one was available.
+        bool try_receive(lua_State *L) {
+            value_buffer message;
+            if (!try_receive(message))
+                return false;
+            message.unpack(L);
+            return true;
+        }
+
+        // Waits for a value. Returns false once the channel is closed and
+        // drained.
+        bool receive(value_buffer &out) {
+            backoff wait;
+            while (!m_queue.try_pop(out)) {
+                if (is_closed() && !m_queue.try_pop(out))
+                    return false;
+                wait.pause();
+            }
+            return true;
+        }
+
+        bool receive(lua_State *L) {
+            value_buffer message;
+            if (!receive(message))
+                return false;
+            message.unpack(L);
+            return true;
+        }
+
+        void close() {
+            m_closed.store(true, std::memory_order_release);
+        }
+
+        bool is_closed() const {
+            return m_closed.load(std::memory_order_acquire);
+        }
+
+        std::size_t capacity() const {
+            return m_queue.capacity();
+        }
+    };
+
+    // Only one thread may send and one thread may receive.
+    typedef basic_channel<spsc_queue<value_buffer>> spsc_channel;
+    // Any number of senders and receivers.
+    typedef basic_channel<mpmc_queue<value_buffer>> mpmc_channel;
+
+    template <typename Channel>
+    struct channel_traits;
+
+    template <>
+    struct channel_traits<spsc_channel> {
+        static const char *metatable() {
+            return "lualao.spsc_channel";
+        }
+    };
+
+    template <>
+    struct channel_traits<mpmc_channel> {
+        static const char *metatable() {
+            return "lualao.mpmc_channel";
+        }
+    };
+
+    // Lua side of a channel: a full userdata holding a shared_ptr to it.
+    //
+    //   ch:send(v)         blocks while full, errors when closed
+    //   ch:try_send(v)     -> boolean
+    //   ch:recv()          -> v, true  | nil, false once closed and drained
+    //   ch:try_recv()      -> v, true  | nil, false when empty
+    //   ch:recv_yield()    like recv, but yields the running coroutine with
+    //                         no values while the channel is empty
+    //   ch:close(), ch:is_closed(), ch:capacity()
+    template <typename Channel>
+    class channel_binding {
+      private:
+        typedef std::shared_ptr<Channel> handle;
+
+        enum receive_status { RECEIVED, EMPTY, CLOSED };
+
+        static Channel &check(lua_State *L) {
+            return **static_cast<handle *>(
+                luaL_checkudata(L, 1, channel_traits<Channel>::metatable()));
+        }
+
+        static int gc(lua_State *L) {
+            static_cast<handle *>(lua_touserdata(L, 1))->~handle();
+            return 0;
+        }
+
+        static int send(lua_State *L) {
+            Channel &ch = check(L);
+            luaL_checkany(L, 2);
+            return translate_exceptions(L, [&]() {
+                ch.send(L, 2);
+                return 0;
+            });
+        }
+
+        static int try_send(lua_State *L) {
+            Channel &ch = check(L);
+            luaL_checkany(L, 2);
+            return translate_exceptions(L, [&]() {
+                lua_pushboolean(L, ch.try_send(L, 2));
+                return 1;
+            });
+        }
+
+        static int push_result(lua_State *L, bool received) {
+            if (!received)
+                lua_pushnil(L);
+            lua_pushboolean(L, received);
+            return 2;
+        }
+
+        static int recv(lua_State *L) {
+            Channel &ch = check(L);
+            return translate_exceptions(
+                L, [&]() { return push_result(L, ch.receive(L)); });
+        }
+
+        static int try_recv(lua_State *L) {
+            Channel &ch = check(L);
+            return translate_exceptions(
+                L, [&]() { return push_result(L, ch.try_receive(L)); });
+        }
+
+        // Kept out of recv_yield so that no C++ object is alive when
+        // lua_yieldk unwinds the C stack.
+        static receive_status poll(lua_State *L, Channel &ch) {
+            if (ch.try_receive(L))
+                return RECEIVED;
+            if (!ch.is_closed())
+                return EMPTY;
+            return ch.try_receive(L) ? RECEIVED : CLOSED;
+        }
+
+        static int recv_yield_continue(lua_State *L, int, lua_KContext) {
+            return recv_yield(L);
+        }
+
+        static int recv_yield(lua_State *L) {
+            Channel &ch = check(L);
+            receive_status status = EMPTY;
+            translate_exceptions(L, [&]() {
+                status = poll(L, ch);
+                return 0;
+            });
+            if (status != EMPTY) {
+                if (status == CLOSED)
+                    lua_pushnil(L);
+                lua_pushboolean(L, status == RECEIVED);
+                return 2;
+            }
+            if (!lua_isyieldable(L))
+                return luaL_error(L, "recv_yield called outside a coroutine");
+            lua_settop(L, 1);
+            return lua_yieldk(L, 0, 0, recv_yield_continue);
+        }
+
+        static int close(lua_State *L) {
+            check(L).close();
+            return 0;
+        }
+
+        static int is_closed(lua_State *L) {
+            lua_pushboolean(L, check(L).is_closed());
+            return 1;
+        }
+
+        static int capacity(lua_State *L) {
+            lua_pushinteger(L, static_cast<lua_Integer>(check(L).capacity()));
+            return 1;
+        }
+
+      public:
+        // The userdata starts out holding an empty handle and only takes
+        // its reference to ch once the metatable (and __gc) is set, so a
+        // memory error in between cannot leak the channel.
+        static void push(lua_State *L, const handle &ch) {
+            void *memory = lua_newuserdata(L, sizeof(handle));
+            handle *slot = new (memory) handle();
+
+            if (luaL_newmetatable(L, channel_traits<Channel>::metatable())) {
+                static const luaL_Reg methods[] = {
+                    {"send", send},
+                    {"try_send", try_send},
+                    {"recv", recv},
+                    {"try_recv", try_recv},
+                    {"recv_yield", recv_yield},
+                    {"close", close},
+                    {"is_closed", is_closed},
+                    {"capacity", capacity},
+                    {nullptr, nullptr}};
+                luaL_newlib(L, methods);
+                lua_setfield(L, -2, "__index");
+                lua_pushcfunction(L, gc);
+                lua_setfield(L, -2, "__gc");
+            }
+            lua_setmetatable(L, -2);
+            *slot = ch;
+        }
+    };
+
+    // Pushes ch onto L as a channel userdata.
+    template <typename Channel>
+    void push_channel(lua_State *L, const std::shared_ptr<Channel> &ch) {
+        run_protected(L, 0, 1, [&ch](lua_State *P) {
+            channel_binding<Channel>::push(P, ch);
+        });
+    }
+
+    // Exposes ch to the scripts of s as the global name.
+    template <typename Channel>
+    void register_channel(state &s, const std::string &name,
+                          const std::shared_ptr<Channel> &ch) {
+        run_protected(s, 0, 0, [&](lua_State *P) {
+            channel_binding<Channel>::push(P, ch);
+            lua_setglobal(P, name.c_str());
+        });
+    }
+
+};
@@ -0,0 +1,336 @@
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/state.hpp"
+
+namespace lualao {
+
+    // Records the globals (and any extra global tables named on creation)
+    // of a warmed state so that every change made afterwards can be undone
+    // with rollback().
+    //
+    // Each tracked table keeps its identity but has its contents moved to
+    // a shadow table; reads fall through __index to the shadow, and every
+    // write goes through a __newindex that saves the key's previous value
+    // in a journal the first time the key is written. rollback() walks the
+    // journals only, so its cost follows the number of keys a request wrote
+    // rather than the size of the state. __len and __pairs are forwarded
+    // to the shadow. Raw accesses (rawget, rawset, next) to a tracked table
+    // see an empty table and bypass the journal, so they must be avoided
+    // while the checkpoint is active. Tracked tables are registered under
+    // path_redirects_key(), so path lookups keep finding their contents
+    // without running metamethods.
+    //
+    // A metatable the table already has is moved to the shadow for as long
+    // as the table is tracked, so its __index still answers missing keys
+    // (the globals of a state opened with open_libs_lazily() keep loading
+    // libraries on demand). Tables whose metatable has a __newindex cannot
+    // be tracked.
+    class checkpoint {
+      public:
+        explicit checkpoint(state s,
+                            const std::vector<std::string> &tables = {})
+            : m_state(s)
+            , m_ref(LUA_NOREF) {
+            run_protected(m_state, 0, 0, [this, &tables](lua_State *L) {
+                lua_createtable(L, static_cast<int>(tables.size()) + 1, 0);
+                m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            });
+            try {
+                run_protected(m_state, 0, 0, [this, &tables](lua_State *L) {
+                    lua_rawgeti(L, LUA_REGISTRYINDEX, m_ref);
+                    int entries = lua_gettop(L);
+                    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+                    track(L, entries);
+                    for (const auto &name : tables) {
+                        if (lua_getglobal(L, name.c_str()) != LUA_TTABLE)
+                            throw lua_exception("'" + name +
+                                                "' is not a table");
+                        track(L, entries);
+                    }
+                });
+            } catch (...) {
+                release();
+                throw;
+            }
+        }
+
+        checkpoint(const checkpoint &) = delete;
+        checkpoint &operator=(const checkpoint &) = delete;
+
+        // Stops tracking; the tables keep their current contents.
+        virtual ~checkpoint() {
+            release();
+        }
+
+        // Undoes every write made since creation or the last rollback or
+        // commit.
+        void rollback() {
+            for_each_journal([](lua_State *L, int shadow, int journal) {
+                lua_pushnil(L);
+                while (lua_next(L, journal) != 0) {
+                    lua_pushvalue(L, -2);
+                    if (lua_touserdata(L, -2) == absent())
+                        lua_pushnil(L);
+                    else
+                        lua_pushvalue(L, -2);
+                    lua_rawset(L, shadow);
+                    lua_pop(L, 1);
+                    lua_pushvalue(L, -1);
+                    lua_pushnil(L);
+                    lua_rawset(L, journal);
+                }
+            });
+        }
+
+        // Accepts the current contents as the new checkpoint.
+        void commit() {
+            for_each_journal([](lua_State *L, int, int journal) {
+                lua_pushnil(L);
+                while (lua_next(L, journal) != 0) {
+                    lua_pop(L, 1);
+                    lua_pushvalue(L, -1);
+                    lua_pushnil(L);
+                    lua_rawset(L, journal);
+                }
+            });
+        }
+
+        // Number of distinct keys written since the last rollback/commit.
+        std::size_t pending_changes() {
+            std::size_t count = 0;
+            for_each_journal([&count](lua_State *L, int, int journal) {
+                lua_pushnil(L);
+                while (lua_next(L, journal) != 0) {
+                    lua_pop(L, 1);
+                    ++count;
+                }
+            });
+            return count;
+        }
+
+      private:
+        state m_state;
+        int m_ref;
+
+        // entry layout in the entries array:
+        // {table, shadow, journal, original metatable}
+        enum { TABLE = 1, SHADOW = 2, JOURNAL = 3, METATABLE = 4 };
+
+        static void *absent() {
+            static const char key = 0;
+            return const_cast<char *>(&key);
+        }
+
+        // Runs f(L, shadow, journal) for every tracked table under a
+        // protected call; rollback() writes to the shadows, which may
+        // allocate.
+        template <typename F>
+        void for_each_journal(F f) {
+            run_protected(m_state, 0, 0, [this, &f](lua_State *L) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, m_ref);
+                int entries = lua_gettop(L);
+                lua_Integer n =
+                    static_cast<lua_Integer>(lua_rawlen(L, entries));
+                for (lua_Integer i = 1; i <= n; ++i) {
+                    lua_rawgeti(L, entries, i);
+                    lua_rawgeti(L, -1, SHADOW);
+                    lua_rawgeti(L, -2, JOURNAL);
+                    f(L, lua_gettop(L) - 1, lua_gettop(L));
+                    lua_settop(L, entries);
+                }
+            });
+        }
+
+        // Untracks every table and drops the entries. A destructor cannot
+        // report a failure, so a state out of memory may be left with some
+        // tables still tracked.
+        void release() {
+            try {
+                run_protected(m_state, 0, 0, [this](lua_State *L) {
+                    lua_rawgeti(L, LUA_REGISTRYINDEX, m_ref);
+                    if (lua_type(L, -1) == LUA_TTABLE)
+                        release_entries(L, lua_gettop(L));
+                    luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+                });
+            } catch (const std::exception &) {
+            }
+            m_ref = LUA_NOREF;
+        }
+
+        // upvalues: shadow, journal
+        static int journaled_newindex(lua_State *L) {
+            lua_settop(L, 3);
+            lua_pushvalue(L, 2);
+            if (lua_rawget(L, lua_upvalueindex(2)) == LUA_TNIL) {
+                lua_pushvalue(L, 2);
+                lua_pushvalue(L, 2);
+                if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL) {
+                    lua_pop(L, 1);
+                    lua_pushlightuserdata(L, absent());
+                }
+                lua_rawset(L, lua_upvalueindex(2));
+            }
+            lua_settop(L, 3);
+            lua_rawset(L, lua_upvalueindex(1));
+            return 0;
+        }
+
+        static int shadow_len(lua_State *L) {
+            lua_pushinteger(
+                L, static_cast<lua_Integer>(lua_rawlen(L, lua_upvalueindex(1))));
+            return 1;
+        }
+
+        static int shadow_next(lua_State *L) {
+            luaL_checktype(L, 1, LUA_TTABLE);
+            lua_settop(L, 2);
+            if (lua_next(L, 1))
+                return 2;
+            lua_pushnil(L);
+            return 1;
+        }
+
+        static int shadow_pairs(lua_State *L) {
+            lua_pushcfunction(L, shadow_next);
+            lua_pushvalue(L, lua_upvalueindex(1));
+            lua_pushnil(L);
+            return 3;
+        }
+
+        // redirects[table] = value at contents (nil to remove), creating
+        // the weak-keyed redirect table on first use.
+        static void set_redirect(lua_State *L, int table, int contents) {
+            if (lua_rawgetp(L, LUA_REGISTRYINDEX, path_redirects_key()) !=
+                LUA_TTABLE) {
+                lua_pop(L, 1);
+                if (lua_isnil(L, contents))
+                    return;
+                lua_newtable(L);
+                lua_createtable(L, 0, 1);
+                lua_pushliteral(L, "k");
+                lua_setfield(L, -2, "__mode");
+                lua_setmetatable(L, -2);
+                lua_pushvalue(L, -1);
+                lua_rawsetp(L, LUA_REGISTRYINDEX, path_redirects_key());
+            }
+            lua_pushvalue(L, table);
+            lua_pushvalue(L, contents);
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+        }
+
+        // Pops the table on top of the stack and starts tracking it.
+        // Everything that allocates runs before the table is changed, so an
+        // error part way leaves it as it was; its entry, once recorded, is
+        // undone by release_entries like any other.
+        static void track(lua_State *L, int entries) {
+            int table = lua_gettop(L);
+            lua_createtable(L, 4, 0);
+            int entry = lua_gettop(L);
+            lua_pushvalue(L, table);
+            lua_rawseti(L, entry, TABLE);
+
+            if (lua_getmetatable(L, table)) {
+                lua_pushliteral(L, "__newindex");
+                if (lua_rawget(L, -2) != LUA_TNIL)
+                    throw lua_exception("cannot checkpoint a table whose "
+                                        "metatable has __newindex");
+                lua_pop(L, 1);
+            } else {
+                lua_pushnil(L);
+            }
+            int metatable = lua_gettop(L);
+            lua_pushvalue(L, metatable);
+            lua_rawseti(L, entry, METATABLE);
+
+            lua_newtable(L);
+            int shadow = lua_gettop(L);
+            lua_pushnil(L);
+            while (lua_next(L, table) != 0) {
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, shadow);
+            }
+            lua_pushvalue(L, shadow);
+            lua_rawseti(L, entry, SHADOW);
+
+            lua_newtable(L);
+            int journal = lua_gettop(L);
+            lua_pushvalue(L, journal);
+            lua_rawseti(L, entry, JOURNAL);
+
+            lua_createtable(L, 0, 4);
+            int tracking = lua_gettop(L);
+            lua_pushvalue(L, shadow);
+            lua_setfield(L, tracking, "__index");
+            lua_pushvalue(L, shadow);
+            lua_pushvalue(L, journal);
+            lua_pushcclosure(L, journaled_newindex, 2);
+            lua_setfield(L, tracking, "__newindex");
+            lua_pushvalue(L, shadow);
+            lua_pushcclosure(L, shadow_len, 1);
+            lua_setfield(L, tracking, "__len");
+            lua_pushvalue(L, shadow);
+            lua_pushcclosure(L, shadow_pairs, 1);
+            lua_setfield(L, tracking, "__pairs");
+
+            lua_pushvalue(L, entry);
+            lua_rawseti(L, entries,
+                        static_cast<lua_Integer>(lua_rawlen(L, entries)) + 1);
+            set_redirect(L, table, shadow);
+
+            // nothing below allocates
+            lua_pushnil(L);
+            while (lua_next(L, table) != 0) {
+                lua_pop(L, 1);
+                lua_pushvalue(L, -1);
+                lua_pushnil(L);
+                lua_rawset(L, table);
+            }
+            lua_pushvalue(L, metatable);
+            lua_setmetatable(L, shadow);
+            lua_pushvalue(L, tracking);
+            lua_setmetatable(L, table);
+            lua_settop(L, table - 1);
+        }
+
+        // Moves shadow contents back into each tracked table and gives it
+        // its original metatable again.
+        static void release_entries(lua_State *L, int entries) {
+            lua_Integer n = static_cast<lua_Integer>(lua_rawlen(L, entries));
+            for (lua_Integer i = 1; i <= n; ++i) {
+                lua_rawgeti(L, entries, i);
+                lua_rawgeti(L, -1, TABLE);
+                int table = lua_gettop(L);
+                lua_rawgeti(L, -2, SHADOW);
+                int shadow = lua_gettop(L);
+                lua_rawgeti(L, -3, METATABLE);
+                lua_setmetatable(L, table);
+                lua_pushnil(L);
+                lua_setmetatable(L, shadow);
+                lua_pushnil(L);
+                set_redirect(L, table, lua_gettop(L));
+                lua_pop(L, 1);
+                lua_pushnil(L);
+                while (lua_next(L, shadow) != 0) {
+                    lua_pushvalue(L, -2);
+                    lua_insert(L, -2);
+                    lua_rawset(L, table);
+                }
+                lua_settop(L, table - 2);
+            }
+        }
+    };
+
+};
@@ -0,0 +1,206 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+extern "C" {
+#include "lua.h"
+}
+
+namespace lualao {
+
+    // lua_Reader handing Lua one in-memory block in a single piece.
+    struct buffer_reader {
+        const char *data;
+        std::size_t size;
+
+        static const char *read(lua_State *, void *ud, std::size_t *size) {
+            buffer_reader *self = static_cast<buffer_reader *>(ud);
+            *size = self->size;
+            self->size = 0;
+            return *size ? self->data : nullptr;
+        }
+    };
+
+    // Compiles (without running) a chunk held in memory and pushes it.
+    // mode is as for lua_load: "t" text only, "b" binary only, "bt" both.
+    inline int load_chunk(lua_State *L, std::string_view chunk,
+                          const char *chunkname, const char *mode = "t") {
+        buffer_reader reader = {chunk.data(), chunk.size()};
+        return lua_load(L, buffer_reader::read, &reader, chunkname, mode);
+    }
+
+    inline std::uint64_t content_hash(std::string_view bytes) {
+        // FNV-1a
+        std::uint64_t h = 14695981039346656037ull;
+        for (char c : bytes) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // Process wide map from script content to its compiled bytecode. The
+    // first state to load a given body parses it and dumps the bytecode;
+    // every later load of the same body (and chunk name, which is baked
+    // into the debug info) is a plain binary load. Entries keep the source
+    // and are only used when it matches byte for byte, so a hash collision
+    // costs a recompile, never the wrong code. The cache holds at most
+    // capacity() bytes of source plus bytecode and evicts the oldest
+    // entries past that. Safe to use from several threads; lookups only
+    // take a shared lock.
+    class chunk_cache {
+      public:
+        static const std::size_t DEFAULT_CAPACITY = 64 << 20;
+
+        static chunk_cache &instance() {
+            static chunk_cache cache;
+            return cache;
+        }
+
+        // Pushes the compiled chunk, like load_chunk. Returns the lua_load
+        // status; a chunk that fails to compile is not cached.
+        int load(lua_State *L, std::string_view source, const char *chunkname) {
+            std::uint64_t key = content_hash(source);
+            std::shared_ptr<const std::string> bytecode;
+            {
+                std::shared_lock<std::shared_mutex> lock(m_lock);
+                auto it = m_entries.find(key);
+                if (it != m_entries.end() && it->second.source == source &&
+                    it->second.chunkname == chunkname)
+                    bytecode = it->second.bytecode;
+            }
+            if (bytecode)
+                return load_chunk(L, *bytecode, chunkname, "b");
+
+            int status = load_chunk(L, source, chunkname, "t");
+            if (status != LUA_OK)
+                return status;
+
+            auto dumped = std::make_shared<std::string>();
+            // the chunk loaded fine; without memory for its bytecode it is
+            // just not cached
+            if (lua_dump(L, write, dumped.get(), 0) != 0)
+                return LUA_OK;
+
+            std::size_t bytes = source.size() + dumped->size();
+            std::unique_lock<std::shared_mutex> lock(m_lock);
+            if (bytes > m_capacity)
+                return LUA_OK;
+            auto it = m_entries.find(key);
+            if (it != m_entries.end()) {
+                // a colliding body, or the same one raced in; keep the newest
+                m_bytes -= it->second.bytes;
+                m_entries.erase(it);
+            }
+            entry &e = m_entries[key];
+            e.source.assign(source.data(), source.size());
+            e.chunkname = chunkname;
+            e.bytecode = dumped;
+            e.bytes = bytes;
+            e.sequence = ++m_sequence;
+            m_order.push_back({key, e.sequence});
+            m_bytes += bytes;
+            evict();
+            return LUA_OK;
+        }
+
+        std::size_t size() const {
+            std::shared_lock<std::shared_mutex> lock(m_lock);
+            return m_entries.size();
+        }
+
+        // Bytes of source and bytecode currently held.
+        std::size_t bytes() const {
+            std::shared_lock<std::shared_mutex> lock(m_lock);
+            return m_bytes;
+        }
+
+        std::size_t capacity() const {
+            std::shared_lock<std::shared_mutex> lock(m_lock);
+            return m_capacity;
+        }
+
+        void set_capacity(std::size_t bytes) {
+            std::unique_lock<std::shared_mutex> lock(m_lock);
+            m_capacity = bytes;
+            evict();
+        }
+
+        void clear() {
+            std::unique_lock<std::shared_mutex> lock(m_lock);
+            m_entries.clear();
+            m_order.clear();
+            m_bytes = 0;
+        }
+
+      private:
+        struct entry {
+            std::string source;
+            std::string chunkname;
+            std::shared_ptr<const std::string> bytecode;
+            std::size_t bytes;
+            std::uint64_t sequence;
+        };
+
+        mutable std::shared_mutex m_lock;
+        std::unordered_map<std::uint64_t, entry> m_entries;
+        // insertion order as (key, sequence); stale pairs are skipped
+        std::deque<std::pair<std::uint64_t, std::uint64_t>> m_order;
+        std::size_t m_bytes = 0;
+        std::size_t m_capacity = DEFAULT_CAPACITY;
+        std::uint64_t m_sequence = 0;
+
+        chunk_cache() = default;
+
+        // Drops the oldest entries until the cache fits; m_lock is held.
+        void evict() {
+            while (m_bytes > m_capacity && !m_order.empty()) {
+                auto oldest = m_order.front();
+                m_order.pop_front();
+                auto it = m_entries.find(oldest.first);
+                if (it == m_entries.end() ||
+                    it->second.sequence != oldest.second)
+                    continue;
+                m_bytes -= it->second.bytes;
+                m_entries.erase(it);
+            }
+            // replaced entries leave stale pairs behind; drop them once
+            // they dominate
+            if (m_order.size() > 2 * m_entries.size() + 16) {
+                std::deque<std::pair<std::uint64_t, std::uint64_t>> live;
+                for (const auto &pair : m_order) {
+                    auto it = m_entries.find(pair.first);
+                    if (it != m_entries.end() &&
+                        it->second.sequence == pair.second)
+                        live.push_back(pair);
+                }
+                m_order.swap(live);
+            }
+        }
+
+        // A failed allocation ends the dump instead of unwinding through
+        // lua_dump.
+        static int write(lua_State *, const void *p, std::size_t size,
+                         void *ud) {
+            try {
+                static_cast<std::string *>(ud)->append(
+                    static_cast<const char *>(p), size);
+            } catch (const std::bad_alloc &) {
+                return 1;
+            }
+            return 0;
+        }
+    };
+
+};
@@ -0,0 +1,35 @@
+
+#pragma once
+
+#include <chrono>
+#include <thread>
+
+namespace lualao {
+
+    // Escalating wait used by the blocking ends of the lock-free queues:
+    // spin briefly, then give up the time slice, then sleep in short naps.
+    class backoff {
+      private:
+        unsigned m_count;
+
+      public:
+        backoff()
+            : m_count(0) {}
+
+        void pause() {
+            if (m_count < 64) {
+                ++m_count;
+            } else if (m_count < 128) {
+                ++m_count;
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+
+        void reset() {
+            m_count = 0;
+        }
+    };
+
+};
@@ -0,0 +1,104 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include "spsc_queue.hpp"
+
+namespace lualao {
+
+    // Bounded multi-producer/multi-consumer queue (Vyukov's array queue).
+    // Every cell carries a sequence number telling producers and consumers
+    // whose turn it is, so the only contended operation is a single CAS on
+    // the enqueue or dequeue position.
+    template <typename T>
+    class mpmc_queue {
+      private:
+        struct cell {
+            std::atomic<std::size_t> sequence;
+            T data;
+        };
+
+        std::size_t m_mask;
+        std::unique_ptr<cell[]> m_cells;
+
+        char m_pad0[CACHE_LINE_SIZE];
+        std::atomic<std::size_t> m_enqueue;
+        char m_pad1[CACHE_LINE_SIZE];
+        std::atomic<std::size_t> m_dequeue;
+        char m_pad2[CACHE_LINE_SIZE];
+
+      public:
+        explicit mpmc_queue(std::size_t capacity)
+            : m_mask(round_up_to_power_of_two(capacity < 2 ? 2 : capacity) -
+                     1)
+            , m_cells(new cell[m_mask + 1])
+            , m_enqueue(0)
+            , m_dequeue(0) {
+            for (std::size_t i = 0; i <= m_mask; ++i)
+                m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        mpmc_queue(const mpmc_queue &) = delete;
+        mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+        // v is only moved from when the push succeeds
+        bool try_push(T &&v) {
+            cell *c;
+            std::size_t pos = m_enqueue.load(std::memory_order_relaxed);
+            for (;;) {
+                c = &m_cells[pos & m_mask];
+                std::size_t seq = c->sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) -
+                                      static_cast<std::ptrdiff_t>(pos);
+                if (diff == 0) {
+                    if (m_enqueue.compare_exchange_weak(
+                            pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = m_enqueue.load(std::memory_order_relaxed);
+                }
+            }
+            c->data = std::move(v);
+            c->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T &out) {
+            cell *c;
+            std::size_t pos = m_dequeue.load(std::memory_order_relaxed);
+            for (;;) {
+                c = &m_cells[pos & m_mask];
+                std::size_t seq = c->sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) -
+                                      static_cast<std::ptrdiff_t>(pos + 1);
+                if (diff == 0) {
+                    if (m_dequeue.compare_exchange_weak(
+                            pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = m_dequeue.load(std::memory_order_relaxed);
+                }
+            }
+            out = std::move(c->data);
+            c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const {
+            return m_dequeue.load(std::memory_order_acquire) >=
+                   m_enqueue.load(std::memory_order_acquire);
+        }
+
+        std::size_t capacity() const {
+            return m_mask + 1;
+        }
+    };
+
+};
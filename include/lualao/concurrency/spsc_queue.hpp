@@ -0,0 +1,88 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace lualao {
+
+    const std::size_t CACHE_LINE_SIZE = 64;
+
+    inline std::size_t round_up_to_power_of_two(std::size_t n) {
+        std::size_t p = 1;
+        while (p < n)
+            p <<= 1;
+        return p;
+    }
+
+    // Bounded single-producer/single-consumer ring buffer. Exactly one thread
+    // may call try_push and exactly one (other) thread may call try_pop.
+    // Each side keeps a cached copy of the other side's index and only
+    // re-reads the shared atomic when the cache says the ring is full/empty.
+    template <typename T>
+    class spsc_queue {
+      private:
+        std::size_t m_mask;
+        std::vector<T> m_slots;
+
+        // consumer owned
+        char m_pad0[CACHE_LINE_SIZE];
+        std::atomic<std::size_t> m_head;
+        std::size_t m_tail_cache;
+
+        // producer owned
+        char m_pad1[CACHE_LINE_SIZE];
+        std::atomic<std::size_t> m_tail;
+        std::size_t m_head_cache;
+        char m_pad2[CACHE_LINE_SIZE];
+
+      public:
+        explicit spsc_queue(std::size_t capacity)
+            : m_mask(round_up_to_power_of_two(capacity ? capacity : 1) - 1)
+            , m_slots(m_mask + 1)
+            , m_head(0)
+            , m_tail_cache(0)
+            , m_tail(0)
+            , m_head_cache(0) {}
+
+        spsc_queue(const spsc_queue &) = delete;
+        spsc_queue &operator=(const spsc_queue &) = delete;
+
+        // v is only moved from when the push succeeds
+        bool try_push(T &&v) {
+            std::size_t tail = m_tail.load(std::memory_order_relaxed);
+            if (tail - m_head_cache > m_mask) {
+                m_head_cache = m_head.load(std::memory_order_acquire);
+                if (tail - m_head_cache > m_mask)
+                    return false;
+            }
+            m_slots[tail & m_mask] = std::move(v);
+            m_tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T &out) {
+            std::size_t head = m_head.load(std::memory_order_relaxed);
+            if (head == m_tail_cache) {
+                m_tail_cache = m_tail.load(std::memory_order_acquire);
+                if (head == m_tail_cache)
+                    return false;
+            }
+            out = std::move(m_slots[head & m_mask]);
+            m_head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const {
+            return m_head.load(std::memory_order_acquire) ==
+                   m_tail.load(std::memory_order_acquire);
+        }
+
+        std::size_t capacity() const {
+            return m_mask + 1;
+        }
+    };
+
+};
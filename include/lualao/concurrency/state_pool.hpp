@@ -0,0 +1,44 @@
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "lualao/state.hpp"
+
+namespace lualao {
+
+    // A fixed set of independent states built by the same factory (typically
+    // one that opens libraries and loads the scripts). Each state may only
+    // be used by one thread at a time; the parallel helpers hand state i to
+    // worker i.
+    class state_pool {
+      public:
+        typedef std::function<state()> factory;
+
+        explicit state_pool(const factory &make, std::size_t size = 0) {
+            if (size == 0)
+                size = std::thread::hardware_concurrency();
+            if (size == 0)
+                size = 1;
+            m_states.reserve(size);
+            for (std::size_t i = 0; i < size; ++i)
+                m_states.push_back(make());
+        }
+
+        virtual ~state_pool() = default;
+
+        std::size_t size() const {
+            return m_states.size();
+        }
+
+        state &operator[](std::size_t i) {
+            return m_states[i];
+        }
+
+      private:
+        std::vector<state> m_states;
+    };
+
+};
@@ -0,0 +1,250 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/chunk_cache.hpp"
+#include "lualao/shared_data.hpp"
+#include "lualao/state.hpp"
+#include "lualao/traceback.hpp"
+
+namespace lualao {
+
+    // One published version of the configuration. Never modified once
+    // published.
+    struct config_snapshot {
+        std::uint64_t version;
+        std::shared_ptr<const shared_data> data;
+    };
+
+    // Publishes immutable configuration snapshots to worker threads,
+    // read-copy-update style. A config script is evaluated once, in a
+    // scratch state, into a shared_data snapshot; the new version replaces
+    // the current one with a single atomic store.
+    //
+    // Workers read through a config_reader, which keeps using the snapshot
+    // it last picked up until its next refresh(), so reads need no
+    // synchronisation at all. Replaced snapshots are freed once every
+    // registered reader has refreshed past them (quiescent state based
+    // reclamation); a reader that never refreshes holds back reclamation,
+    // never correctness.
+    class config_publisher {
+      public:
+        static const std::size_t MAX_READERS = 256;
+
+        config_publisher()
+            : m_current(new config_snapshot{0, nullptr}) {
+            for (auto &seen : m_seen)
+                seen.store(FREE_SLOT, std::memory_order_relaxed);
+        }
+
+        config_publisher(const config_publisher &) = delete;
+        config_publisher &operator=(const config_publisher &) = delete;
+
+        // Readers must be gone by now.
+        ~config_publisher() {
+            delete m_current.load(std::memory_order_relaxed);
+            for (const config_snapshot *old : m_retired)
+                delete old;
+        }
+
+        // Publishes data as the next version and returns its number.
+        std::uint64_t publish(std::shared_ptr<const shared_data> data) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            const config_snapshot *old =
+                m_current.load(std::memory_order_relaxed);
+            const config_snapshot *next =
+                new config_snapshot{old->version + 1, std::move(data)};
+            m_current.store(next, std::memory_order_release);
+            m_retired.push_back(old);
+            reclaim();
+            return next->version;
+        }
+
+        // Runs a config script and publishes what it defines: the table it
+        // returns, or else the globals it set. Values that cannot be part
+        // of a snapshot (functions, userdata) are left out. Script errors
+        // throw lua_exception and leave the current version in place.
+        std::uint64_t publish(std::string_view source,
+                              const std::string &chunkname = "=config") {
+            state scratch;
+            scratch.open_libs();
+            lua_State *L = scratch;
+
+            int status = load_chunk(L, source, chunkname.c_str());
+            if (status != LUA_OK)
+                throw_lua_error(L, status);
+
+            // globals set by the script land in env; reads fall through
+            // to the standard library
+            lua_newtable(L);
+            lua_createtable(L, 0, 1);
+            lua_pushglobaltable(L);
+            lua_setfield(L, -2, "__index");
+            lua_setmetatable(L, -2);
+            lua_pushvalue(L, -1);
+            lua_setupvalue(L, -3, 1);
+            lua_insert(L, -2);
+
+            status = pcall_with_traceback(L, 0, 1);
+            if (status != LUA_OK)
+                throw_lua_error(L, status);
+            if (!lua_istable(L, -1))
+                lua_pop(L, 1);
+            return publish(shared_data::from_lua(L, -1, true));
+        }
+
+        std::uint64_t publish_file(const std::string &path) {
+            std::ifstream file(path, std::ios::binary);
+            if (!file)
+                throw lua_exception("cannot open config " + path);
+            std::ostringstream contents;
+            contents << file.rdbuf();
+            return publish(contents.str(), "@" + path);
+        }
+
+        std::uint64_t version() const {
+            return m_current.load(std::memory_order_acquire)->version;
+        }
+
+        // Snapshots replaced but not yet freed.
+        std::size_t pending_reclamation() const {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_retired.size();
+        }
+
+      private:
+        friend class config_reader;
+
+        static constexpr std::uint64_t FREE_SLOT =
+            std::numeric_limits<std::uint64_t>::max();
+
+        std::atomic<const config_snapshot *> m_current;
+        // oldest version each registered reader may still be using
+        std::atomic<std::uint64_t> m_seen[MAX_READERS];
+        mutable std::mutex m_lock;
+        std::vector<const config_snapshot *> m_retired;
+
+        // Called with m_lock held.
+        void reclaim() {
+            std::uint64_t oldest = FREE_SLOT;
+            for (auto &seen : m_seen) {
+                std::uint64_t v = seen.load(std::memory_order_acquire);
+                if (v < oldest)
+                    oldest = v;
+            }
+            std::size_t kept = 0;
+            for (const config_snapshot *old : m_retired) {
+                if (old->version < oldest)
+                    delete old;
+                else
+                    m_retired[kept++] = old;
+            }
+            m_retired.resize(kept);
+        }
+
+        std::size_t attach(const config_snapshot *&snapshot) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            for (std::size_t slot = 0; slot < MAX_READERS; ++slot) {
+                if (m_seen[slot].load(std::memory_order_relaxed) ==
+                    FREE_SLOT) {
+                    snapshot = m_current.load(std::memory_order_relaxed);
+                    m_seen[slot].store(snapshot->version,
+                                       std::memory_order_relaxed);
+                    return slot;
+                }
+            }
+            throw lua_exception("too many config readers");
+        }
+
+        void detach(std::size_t slot) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_seen[slot].store(FREE_SLOT, std::memory_order_release);
+            reclaim();
+        }
+    };
+
+    // A worker's view of a config_publisher; owned and used by one thread.
+    // snapshot() is a plain pointer read. refresh() is the quiescent
+    // point: call it between units of work (requests, frames), never while
+    // something from the old snapshot is still in use on the C++ side.
+    // Lua code is unaffected, its handles keep their data alive.
+    class config_reader {
+      public:
+        explicit config_reader(config_publisher &publisher)
+            : m_publisher(publisher)
+            , m_snapshot(nullptr) {
+            m_slot = m_publisher.attach(m_snapshot);
+        }
+
+        config_reader(const config_reader &) = delete;
+        config_reader &operator=(const config_reader &) = delete;
+
+        ~config_reader() {
+            m_publisher.detach(m_slot);
+        }
+
+        // Picks up the latest version; returns true when it changed.
+        bool refresh() {
+            const config_snapshot *latest =
+                m_publisher.m_current.load(std::memory_order_acquire);
+            bool changed = latest != m_snapshot;
+            if (changed) {
+                m_snapshot = latest;
+                for (auto &binding : m_bindings)
+                    install(binding.first, binding.second);
+            }
+            m_publisher.m_seen[m_slot].store(m_snapshot->version,
+                                             std::memory_order_release);
+            return changed;
+        }
+
+        const config_snapshot &snapshot() const {
+            return *m_snapshot;
+        }
+
+        std::uint64_t version() const {
+            return m_snapshot->version;
+        }
+
+        // Exposes the snapshot to s as the global name, as read-only shared
+        // data; refresh() swaps in new versions.
+        void bind(state s, const std::string &name) {
+            install(s, name);
+            m_bindings.emplace_back(s, name);
+        }
+
+      private:
+        config_publisher &m_publisher;
+        std::size_t m_slot;
+        const config_snapshot *m_snapshot;
+        std::vector<std::pair<state, std::string>> m_bindings;
+
+        void install(state &s, const std::string &name) {
+            if (m_snapshot->data)
+                register_shared_data(s, name, m_snapshot->data);
+            else
+                run_protected(s, 0, 0, [&name](lua_State *L) {
+                    lua_pushnil(L);
+                    lua_setglobal(L, name.c_str());
+                });
+        }
+    };
+
+};
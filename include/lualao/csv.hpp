@@ -0,0 +1,486 @@
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/module.hpp"
+#include "lualao/simd.hpp"
+#include "lualao/traceback.hpp"
+#include "lualao/type_references/function_reference.hpp"
+
+namespace lualao {
+
+    // Reads delimited records (RFC 4180 style: quoted fields may hold
+    // delimiters, newlines and "" escapes) from a file in large chunks.
+    // Fields are spans into the chunk buffer, found with a vectorised
+    // search for the delimiter and newline; nothing is copied until a field
+    // is asked for, and quoted fields are unescaped in place on first
+    // access. Blank lines are skipped.
+    class csv_reader {
+      public:
+        static const std::size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+        explicit csv_reader(const std::string &path, char delimiter = ',',
+                            std::size_t chunk_size = DEFAULT_CHUNK_SIZE)
+            : m_file(std::fopen(path.c_str(), "rb"))
+            , m_delimiter(delimiter)
+            , m_buffer(chunk_size > 16 ? chunk_size : 16)
+            , m_begin(0)
+            , m_end(0)
+            , m_eof(false)
+            , m_records(0) {
+            if (m_file == nullptr)
+                throw lua_exception("cannot open " + path);
+        }
+
+        csv_reader(const csv_reader &) = delete;
+        csv_reader &operator=(const csv_reader &) = delete;
+
+        ~csv_reader() {
+            close();
+        }
+
+        // Rows handed to scripts stop working once the reader is closed.
+        void close() {
+            if (m_file != nullptr)
+                std::fclose(m_file);
+            m_file = nullptr;
+            m_eof = true;
+            m_begin = m_end = 0;
+            m_fields.clear();
+        }
+
+        bool is_closed() const {
+            return m_file == nullptr;
+        }
+
+        // Advances to the next record; false at the end of the file. The
+        // previous record's fields are invalid afterwards.
+        bool next() {
+            m_fields.clear();
+            for (;;) {
+                if (m_begin == m_end) {
+                    if (m_eof)
+                        return false;
+                    fill();
+                    continue;
+                }
+                switch (parse_record()) {
+                    case RECORD:
+                        ++m_records;
+                        return true;
+                    case BLANK:
+                        break;
+                    case INCOMPLETE:
+                        fill();
+                        break;
+                }
+            }
+        }
+
+        bool exhausted() const {
+            return m_eof && m_begin == m_end;
+        }
+
+        // Records read so far; also identifies the current record.
+        std::uint64_t record_number() const {
+            return m_records;
+        }
+
+        std::size_t field_count() const {
+            return m_fields.size();
+        }
+
+        // Field i (0 based) of the current record.
+        std::string_view field(std::size_t i) {
+            field_span &f = m_fields[i];
+            if (f.escaped) {
+                // collapse "" into " in place
+                char *text = m_buffer.data() + f.offset;
+                std::size_t out = 0;
+                for (std::size_t in = 0; in < f.length; ++in, ++out) {
+                    text[out] = text[in];
+                    if (text[in] == '"')
+                        ++in;
+                }
+                f.length = out;
+                f.escaped = false;
+            }
+            return std::string_view(m_buffer.data() + f.offset, f.length);
+        }
+
+      private:
+        enum parse_status { RECORD, BLANK, INCOMPLETE };
+
+        struct field_span {
+            std::size_t offset;
+            std::size_t length;
+            bool escaped;
+        };
+
+        std::FILE *m_file;
+        char m_delimiter;
+        std::vector<char> m_buffer;
+        std::size_t m_begin; // start of the unparsed data
+        std::size_t m_end;   // end of the data read so far
+        bool m_eof;
+        std::uint64_t m_records;
+        std::vector<field_span> m_fields;
+
+        // Moves the unparsed tail to the front (growing the buffer when a
+        // single record fills it) and reads more.
+        void fill() {
+            std::size_t pending = m_end - m_begin;
+            if (m_begin > 0)
+                std::memmove(m_buffer.data(), m_buffer.data() + m_begin,
+                             pending);
+            m_begin = 0;
+            m_end = pending;
+            if (m_end == m_buffer.size())
+                m_buffer.resize(m_buffer.size() * 2);
+            std::size_t read = m_file ? std::fread(m_buffer.data() + m_end, 1,
+                                                   m_buffer.size() - m_end,
+                                                   m_file)
+                                      : 0;
+            if (read == 0)
+                m_eof = true;
+            m_end += read;
+        }
+
+        // First delimiter or newline in [pos, end), or end.
+        std::size_t find_field_end(std::size_t pos, std::size_t end) const {
+            const char *data = m_buffer.data();
+#ifdef LUALAO_SSE2
+            const __m128i delimiter = _mm_set1_epi8(m_delimiter);
+            const __m128i newline = _mm_set1_epi8('\n');
+            for (; pos + 16 <= end; pos += 16) {
+                __m128i chunk = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + pos));
+                unsigned hits = static_cast<unsigned>(_mm_movemask_epi8(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, delimiter),
+                                 _mm_cmpeq_epi8(chunk, newline))));
+                if (hits != 0)
+                    return pos + trailing_zeros(hits);
+            }
+#endif
+            for (; pos < end; ++pos) {
+                if (data[pos] == m_delimiter || data[pos] == '\n')
+                    return pos;
+            }
+            return end;
+        }
+
+        parse_status finish(std::size_t next) {
+            m_begin = next;
+            return RECORD;
+        }
+
+        parse_status parse_record() {
+            const char *data = m_buffer.data();
+            std::size_t pos = m_begin;
+            std::size_t end = m_end;
+            m_fields.clear();
+
+            if (data[pos] == '\n') {
+                m_begin = pos + 1;
+                return BLANK;
+            }
+            if (data[pos] == '\r') {
+                if (pos + 1 == end && !m_eof)
+                    return INCOMPLETE;
+                if (pos + 1 == end || data[pos + 1] == '\n') {
+                    m_begin = pos + 1 == end ? end : pos + 2;
+                    return BLANK;
+                }
+            }
+
+            for (;;) {
+                if (pos < end && data[pos] == '"') {
+                    std::size_t close = pos + 1;
+                    bool escaped = false;
+                    for (;;) {
+                        const void *quote =
+                            std::memchr(data + close, '"', end - close);
+                        if (quote == nullptr) {
+                            if (m_eof)
+                                throw lua_exception(
+                                    "csv: unterminated quoted field");
+                            return INCOMPLETE;
+                        }
+                        close = static_cast<const char *>(quote) - data;
+                        if (close + 1 == end && !m_eof)
+                            return INCOMPLETE;
+                        if (close + 1 < end && data[close + 1] == '"') {
+                            escaped = true;
+                            close += 2;
+                            continue;
+                        }
+                        break;
+                    }
+                    m_fields.push_back({pos + 1, close - pos - 1, escaped});
+                    pos = close + 1;
+                    if (pos == end)
+                        return finish(end);
+                    char c = data[pos];
+                    if (c == m_delimiter) {
+                        ++pos;
+                        continue;
+                    }
+                    if (c == '\n')
+                        return finish(pos + 1);
+                    if (c == '\r') {
+                        if (pos + 1 == end)
+                            return m_eof ? finish(end) : INCOMPLETE;
+                        if (data[pos + 1] == '\n')
+                            return finish(pos + 2);
+                    }
+                    throw lua_exception(
+                        "csv: unexpected character after quoted field");
+                }
+
+                std::size_t hit = find_field_end(pos, end);
+                if (hit == end && !m_eof)
+                    return INCOMPLETE;
+                if (hit < end && data[hit] == m_delimiter) {
+                    m_fields.push_back({pos, hit - pos, false});
+                    pos = hit + 1;
+                    continue;
+                }
+                std::size_t field_end = hit;
+                if (field_end > pos && data[field_end - 1] == '\r')
+                    --field_end;
+                m_fields.push_back({pos, field_end - pos, false});
+                return finish(hit < end ? hit + 1 : end);
+            }
+        }
+    };
+
+    // What rows read through: a slot holding the reader. The userdata of a
+    // reader opened from Lua is one (its __gc deletes the reader);
+    // drive_csv makes one for the host's reader and clears it when the call
+    // ends, so rows a script kept cannot reach a reader that is gone.
+    struct csv_cursor {
+        csv_reader *reader;
+    };
+
+    // A row handed to scripts: a view of one record, valid until the
+    // reader moves on. Every record gets a row of its own, so a row kept
+    // from an earlier record reports an error instead of reading the
+    // current one. Indexing creates the Lua string for just that field.
+    struct csv_row {
+        csv_cursor *cursor;
+        std::uint64_t record;
+
+        static constexpr const char *METATABLE = "lualao.csv_row";
+    };
+
+    inline csv_reader &check_current_row(lua_State *L, csv_row *row) {
+        csv_reader *reader = row->cursor->reader;
+        if (reader == nullptr || reader->is_closed())
+            luaL_error(L, "csv row used after its reader was closed");
+        if (reader->record_number() != row->record)
+            luaL_error(L, "csv row used after the reader moved on");
+        return *reader;
+    }
+
+    inline int csv_row_index(lua_State *L) {
+        csv_row *row =
+            static_cast<csv_row *>(luaL_checkudata(L, 1, csv_row::METATABLE));
+        csv_reader &reader = check_current_row(L, row);
+        lua_Integer i = luaL_checkinteger(L, 2);
+        if (i < 1 || static_cast<std::size_t>(i) > reader.field_count())
+            return 0;
+        std::string_view text = reader.field(static_cast<std::size_t>(i - 1));
+        lua_pushlstring(L, text.data(), text.size());
+        return 1;
+    }
+
+    inline int csv_row_len(lua_State *L) {
+        csv_row *row =
+            static_cast<csv_row *>(luaL_checkudata(L, 1, csv_row::METATABLE));
+        lua_pushinteger(L, static_cast<lua_Integer>(
+                               check_current_row(L, row).field_count()));
+        return 1;
+    }
+
+    // Pushes a row for the current record of the reader in the cursor at
+    // index; the row keeps the cursor alive.
+    inline csv_row *push_csv_row(lua_State *L, int cursor) {
+        cursor = lua_absindex(L, cursor);
+        csv_row *row =
+            static_cast<csv_row *>(lua_newuserdata(L, sizeof(csv_row)));
+        row->cursor = static_cast<csv_cursor *>(lua_touserdata(L, cursor));
+        row->record = row->cursor->reader->record_number();
+        if (luaL_newmetatable(L, csv_row::METATABLE)) {
+            static const luaL_Reg methods[] = {{"__index", csv_row_index},
+                                               {"__len", csv_row_len},
+                                               {nullptr, nullptr}};
+            luaL_setfuncs(L, methods, 0);
+        }
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, cursor);
+        lua_setuservalue(L, -2);
+        return row;
+    }
+
+    inline constexpr const char *CSV_READER_METATABLE = "lualao.csv_reader";
+
+    inline csv_reader *check_csv_reader(lua_State *L, int index) {
+        return static_cast<csv_cursor *>(
+                   luaL_checkudata(L, index, CSV_READER_METATABLE))
+            ->reader;
+    }
+
+    // reader:next() -> row or nil.
+    inline int csv_reader_next(lua_State *L) {
+        csv_reader *reader = check_csv_reader(L, 1);
+        bool more = false;
+        translate_exceptions(L, [&]() {
+            more = reader->next();
+            return 0;
+        });
+        if (!more)
+            return 0;
+        push_csv_row(L, 1);
+        return 1;
+    }
+
+    // for row in reader:rows() do ... end
+    inline int csv_reader_rows(lua_State *L) {
+        check_csv_reader(L, 1);
+        lua_pushcfunction(L, csv_reader_next);
+        lua_pushvalue(L, 1);
+        return 2;
+    }
+
+    inline int csv_reader_close(lua_State *L) {
+        check_csv_reader(L, 1)->close();
+        return 0;
+    }
+
+    inline int csv_reader_gc(lua_State *L) {
+        csv_cursor *cursor = static_cast<csv_cursor *>(lua_touserdata(L, 1));
+        delete cursor->reader;
+        cursor->reader = nullptr;
+        return 0;
+    }
+
+    // csv.open(path [, delimiter]) -> reader
+    inline int csv_open(lua_State *L) {
+        const char *path = luaL_checkstring(L, 1);
+        std::size_t length = 0;
+        const char *delimiter = luaL_optlstring(L, 2, ",", &length);
+        luaL_argcheck(L, length == 1, 2, "delimiter must be one character");
+
+        // the userdata gets its metatable (and __gc) while still empty, so
+        // nothing that fails afterwards can leak the reader
+        csv_cursor *cursor =
+            static_cast<csv_cursor *>(lua_newuserdata(L, sizeof(csv_cursor)));
+        cursor->reader = nullptr;
+        if (luaL_newmetatable(L, CSV_READER_METATABLE)) {
+            static const luaL_Reg methods[] = {{"next", csv_reader_next},
+                                               {"rows", csv_reader_rows},
+                                               {"close", csv_reader_close},
+                                               {nullptr, nullptr}};
+            luaL_newlib(L, methods);
+            lua_setfield(L, -2, "__index");
+            lua_pushcfunction(L, csv_reader_gc);
+            lua_setfield(L, -2, "__gc");
+        }
+        lua_setmetatable(L, -2);
+        translate_exceptions(L, [&]() {
+            cursor->reader = new csv_reader(path, delimiter[0]);
+            return 0;
+        });
+        return 1;
+    }
+
+    inline int csv_batch_next(lua_State *L) {
+        csv_cursor *cursor =
+            static_cast<csv_cursor *>(lua_touserdata(L, lua_upvalueindex(1)));
+        lua_Integer remaining = lua_tointeger(L, lua_upvalueindex(2));
+        if (remaining <= 0 || cursor->reader == nullptr)
+            return 0;
+        bool more = false;
+        translate_exceptions(L, [&]() {
+            more = cursor->reader->next();
+            return 0;
+        });
+        lua_pushinteger(L, more ? remaining - 1 : 0);
+        lua_replace(L, lua_upvalueindex(2));
+        if (!more)
+            return 0;
+        push_csv_row(L, lua_upvalueindex(1));
+        return 1;
+    }
+
+    // Feeds reader to the Lua function at function_index in batches: each
+    // call gets an iterator over up to batch records
+    //
+    //     function(rows) for row in rows do ... end end
+    //
+    // so the cost of a protected call is paid once per batch. Rows are
+    // only valid during the call. Stops at the end of the file, or when a
+    // call consumed no rows. Returns the number of records read; script
+    // errors throw lua_exception.
+    inline std::uint64_t drive_csv(lua_State *L, csv_reader &reader,
+                                   int function_index,
+                                   std::size_t batch = 256) {
+        std::uint64_t first = reader.record_number();
+        csv_cursor *cursor = nullptr;
+        lua_pushvalue(L, function_index);
+        try {
+            // protected: creating the cursor, the rows and the iterators
+            // allocates
+            run_protected(L, 1, 0, [&](lua_State *P) {
+                cursor = static_cast<csv_cursor *>(
+                    lua_newuserdata(P, sizeof(csv_cursor)));
+                cursor->reader = &reader;
+                while (!reader.exhausted()) {
+                    std::uint64_t before = reader.record_number();
+                    lua_pushvalue(P, 1);
+                    lua_pushvalue(P, 2);
+                    lua_pushinteger(P, static_cast<lua_Integer>(batch));
+                    lua_pushcclosure(P, csv_batch_next, 2);
+                    int status = pcall_with_traceback(P, 1, 0);
+                    if (status != LUA_OK)
+                        throw_lua_error(P, status);
+                    if (reader.record_number() == before)
+                        break;
+                }
+            });
+        } catch (...) {
+            if (cursor != nullptr)
+                cursor->reader = nullptr;
+            throw;
+        }
+        cursor->reader = nullptr;
+        return reader.record_number() - first;
+    }
+
+    // Same, for a function already on the stack; the function stays there.
+    inline std::uint64_t drive_csv(csv_reader &reader,
+                                   function_reference &callback,
+                                   std::size_t batch = 256) {
+        return drive_csv(callback.lua_state(), reader, callback.index(),
+                         batch);
+    }
+
+    inline constexpr luaL_Reg csv_functions[] = {{"open", csv_open},
+                                                 {nullptr, nullptr}};
+
+    // require("csv") once registered with preload_module().
+    inline constexpr module csv_module = make_module("csv", csv_functions);
+
+};
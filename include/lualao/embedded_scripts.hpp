@@ -0,0 +1,112 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/chunk_cache.hpp"
+
+namespace lualao {
+
+    struct embedded_script {
+        const char *name; // module name, e.g. "game.rules"
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    // Scripts linked into the binary by LUALAO_EMBED_SCRIPTS (see
+    // cmake/embed_scripts.cmake): one blob of precompiled chunks plus an
+    // index sorted by module name. The generated source defines
+    //
+    //     extern const lualao::embedded_bundle <symbol>;
+    struct embedded_bundle {
+        const embedded_script *scripts;
+        std::size_t count;
+        const unsigned char *data;
+
+        // Binary search by module name; nullptr when absent.
+        const embedded_script *find(std::string_view name) const {
+            std::size_t low = 0;
+            std::size_t high = count;
+            while (low < high) {
+                std::size_t mid = low + (high - low) / 2;
+                int order = name.compare(scripts[mid].name);
+                if (order == 0)
+                    return &scripts[mid];
+                if (order < 0)
+                    high = mid;
+                else
+                    low = mid + 1;
+            }
+            return nullptr;
+        }
+
+        std::string_view chunk(const embedded_script &script) const {
+            return std::string_view(
+                reinterpret_cast<const char *>(data) + script.offset,
+                script.size);
+        }
+    };
+
+    // package.searchers entry: returns the loader for an embedded module,
+    // straight from its bytecode, or the "not found" note require expects.
+    inline int embedded_searcher(lua_State *L) {
+        const embedded_bundle *bundle = static_cast<const embedded_bundle *>(
+            lua_touserdata(L, lua_upvalueindex(1)));
+        std::size_t length = 0;
+        const char *name = luaL_checklstring(L, 1, &length);
+        const embedded_script *script =
+            bundle->find(std::string_view(name, length));
+        if (script == nullptr) {
+            lua_pushfstring(L, "\n\tno embedded module '%s'", name);
+            return 1;
+        }
+
+        const char *chunkname = lua_pushfstring(L, "=%s", name);
+        // "bt": bundles built without luac carry source text
+        int status = load_chunk(L, bundle->chunk(*script), chunkname, "bt");
+        if (status != LUA_OK)
+            return luaL_error(L, "error loading embedded module '%s':\n\t%s",
+                              name, lua_tostring(L, -1));
+        // loader, then the extra value handed to it
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    // Puts a searcher for bundle right after the package.preload one, so
+    // require finds embedded modules before touching the filesystem.
+    // Needs the package library to be open; bundle must outlive the
+    // state (the generated bundles are static).
+    inline void install_embedded_searcher(lua_State *L,
+                                          const embedded_bundle &bundle) {
+        lua_getglobal(L, "package");
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            throw lua_exception("package library is not open");
+        }
+        lua_getfield(L, -1, "searchers");
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 2);
+            throw lua_exception("package.searchers is missing");
+        }
+
+        // shift entries 2..n up by one
+        lua_Integer n = static_cast<lua_Integer>(lua_rawlen(L, -1));
+        for (lua_Integer i = n; i >= 2; --i) {
+            lua_rawgeti(L, -1, i);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pushlightuserdata(L, const_cast<embedded_bundle *>(&bundle));
+        lua_pushcclosure(L, embedded_searcher, 1);
+        lua_rawseti(L, -2, n >= 1 ? 2 : 1);
+        lua_pop(L, 2);
+    }
+
+};
@@ -0,0 +1,116 @@
+
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <set>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef __linux__
+    #include <sys/inotify.h>
+    #include <unistd.h>
+#endif
+
+#include "lualao/lua_exception.hpp"
+
+namespace lualao {
+
+    // Reports files that changed on disk since the last poll(). On Linux it
+    // uses inotify on the parent directories (so editors that save through
+    // a rename are seen too); elsewhere it compares modification times.
+    // poll() never blocks.
+    class file_watcher {
+      public:
+        file_watcher() {
+#ifdef __linux__
+            m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (m_fd < 0)
+                throw lua_exception("inotify_init1 failed");
+#endif
+        }
+
+        file_watcher(const file_watcher &) = delete;
+        file_watcher &operator=(const file_watcher &) = delete;
+
+        virtual ~file_watcher() {
+#ifdef __linux__
+            close(m_fd);
+#endif
+        }
+
+        // Returns the normalised path under which changes are reported.
+        std::string watch(const std::string &file) {
+            std::filesystem::path p =
+                std::filesystem::absolute(file).lexically_normal();
+            std::string key = p.string();
+            if (!m_files.insert(key).second)
+                return key;
+#ifdef __linux__
+            std::string dir = p.parent_path().string();
+            if (m_dirs.count(dir) == 0) {
+                int wd = inotify_add_watch(m_fd, dir.c_str(),
+                                           IN_CLOSE_WRITE | IN_MOVED_TO);
+                if (wd < 0)
+                    throw lua_exception("cannot watch directory " + dir);
+                m_dirs.insert(dir);
+                m_watches[wd] = dir;
+            }
+#else
+            m_times[key] = modified(p);
+#endif
+            return key;
+        }
+
+        std::vector<std::string> poll() {
+            std::set<std::string> changed;
+#ifdef __linux__
+            alignas(inotify_event) char buffer[4096];
+            for (;;) {
+                ssize_t n = read(m_fd, buffer, sizeof(buffer));
+                if (n <= 0)
+                    break;
+                for (char *p = buffer; p < buffer + n;) {
+                    inotify_event *event = reinterpret_cast<inotify_event *>(p);
+                    p += sizeof(inotify_event) + event->len;
+                    auto dir = m_watches.find(event->wd);
+                    if (dir == m_watches.end() || event->len == 0)
+                        continue;
+                    std::string file =
+                        (std::filesystem::path(dir->second) / event->name)
+                            .string();
+                    if (m_files.count(file))
+                        changed.insert(file);
+                }
+            }
+#else
+            for (auto &kv : m_times) {
+                std::filesystem::file_time_type now = modified(kv.first);
+                if (now != kv.second) {
+                    kv.second = now;
+                    changed.insert(kv.first);
+                }
+            }
+#endif
+            return std::vector<std::string>(changed.begin(), changed.end());
+        }
+
+      private:
+        std::set<std::string> m_files;
+#ifdef __linux__
+        int m_fd;
+        std::set<std::string> m_dirs;
+        std::map<int, std::string> m_watches;
+#else
+        std::map<std::string, std::filesystem::file_time_type> m_times;
+
+        static std::filesystem::file_time_type
+        modified(const std::filesystem::path &p) {
+            std::error_code ec;
+            return std::filesystem::last_write_time(p, ec);
+        }
+#endif
+    };
+
+};
@@ -0,0 +1,123 @@
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/state_extension.hpp"
+#include "lualao/metrics/latency_histogram.hpp"
+
+namespace lualao {
+
+    // Per-state record of how long the collector work we drove took.
+    struct gc_statistics {
+        latency_histogram step_durations;
+        latency_histogram collect_durations;
+    };
+
+    // Typed access to lua_gc for one state (see state::gc()). Explicit
+    // steps and full collections are timed into the state's gc_statistics
+    // in nanoseconds, so latency spikes can be matched against collector
+    // work the host drove. Only those are timed: the incremental steps Lua
+    // takes by itself while allocating are not measured.
+    class gc_control {
+      public:
+        explicit gc_control(lua_State *L)
+            : m_state(L) {}
+
+        // Both setters return the previous value.
+        int set_pause(int percent) {
+            return lua_gc(m_state, LUA_GCSETPAUSE, percent);
+        }
+
+        int set_step_multiplier(int percent) {
+            return lua_gc(m_state, LUA_GCSETSTEPMUL, percent);
+        }
+
+        void stop() {
+            lua_gc(m_state, LUA_GCSTOP, 0);
+        }
+
+        void restart() {
+            lua_gc(m_state, LUA_GCRESTART, 0);
+        }
+
+        bool is_running() {
+            return lua_gc(m_state, LUA_GCISRUNNING, 0) != 0;
+        }
+
+        // Performs about kb kilobytes of collection work (0 means one basic
+        // step). Returns true when the step finished a cycle.
+        bool step(int kb = 0) {
+            auto start = std::chrono::steady_clock::now();
+            bool finished = lua_gc(m_state, LUA_GCSTEP, kb) != 0;
+            statistics().step_durations.record(elapsed_since(start));
+            return finished;
+        }
+
+        // Runs steps of kb kilobytes until the budget is spent or a cycle
+        // finishes; meant for idle periods. Returns true if a cycle
+        // finished.
+        bool step_for(std::chrono::microseconds budget, int kb = 16) {
+            auto deadline = std::chrono::steady_clock::now() + budget;
+            do {
+                if (step(kb))
+                    return true;
+            } while (std::chrono::steady_clock::now() < deadline);
+            return false;
+        }
+
+        void collect() {
+            auto start = std::chrono::steady_clock::now();
+            lua_gc(m_state, LUA_GCCOLLECT, 0);
+            statistics().collect_durations.record(elapsed_since(start));
+        }
+
+        // Bytes currently allocated by the state.
+        std::size_t memory_in_use() {
+            return static_cast<std::size_t>(lua_gc(m_state, LUA_GCCOUNT, 0)) *
+                       1024 +
+                   static_cast<std::size_t>(lua_gc(m_state, LUA_GCCOUNTB, 0));
+        }
+
+        histogram_snapshot step_durations() {
+            return statistics().step_durations.snapshot();
+        }
+
+        histogram_snapshot collect_durations() {
+            return statistics().collect_durations.snapshot();
+        }
+
+      private:
+        lua_State *m_state;
+
+        // Created under a protected call on first use, so a state at its
+        // memory limit gets lua_memory_error rather than a panic.
+        gc_statistics &statistics() {
+            gc_statistics *existing =
+                find_state_extension<gc_statistics>(m_state);
+            if (existing != nullptr)
+                return *existing;
+            gc_statistics *created = nullptr;
+            run_protected(m_state, 0, 0, [&created](lua_State *L) {
+                created = &state_extension<gc_statistics>(L);
+            });
+            return *created;
+        }
+
+        static std::uint64_t
+        elapsed_since(std::chrono::steady_clock::time_point start) {
+            return static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count());
+        }
+    };
+
+};
@@ -0,0 +1,716 @@
+
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/module.hpp"
+#include "lualao/simd.hpp"
+#include "lualao/state_extension.hpp"
+
+namespace lualao {
+
+    // Stage one of decoding: the offsets of every structural character
+    // ({ } [ ] : , and the quotes around strings) outside of strings, plus
+    // the number of elements of each array and object, so stage two can
+    // presize the tables it creates.
+    //
+    // With SSE2 the input is classified 16 bytes at a time: quotes and
+    // structural characters come out as bit masks, and a prefix xor over
+    // the quote mask tells which bytes are inside strings. Blocks holding a
+    // backslash take the scalar path, which tracks escapes.
+    class json_index {
+      public:
+        void build(std::string_view text) {
+            if (text.size() >= UINT32_MAX)
+                throw lua_exception("json: document too large");
+            m_positions.clear();
+            const char *data = text.data();
+            std::size_t size = text.size();
+            std::size_t i = 0;
+            bool in_string = false;
+            bool escaped = false;
+
+#ifdef LUALAO_SSE2
+            const __m128i quote = _mm_set1_epi8('"');
+            const __m128i backslash = _mm_set1_epi8('\\');
+            const __m128i open_brace = _mm_set1_epi8('{');
+            const __m128i close_brace = _mm_set1_epi8('}');
+            const __m128i open_bracket = _mm_set1_epi8('[');
+            const __m128i close_bracket = _mm_set1_epi8(']');
+            const __m128i colon = _mm_set1_epi8(':');
+            const __m128i comma = _mm_set1_epi8(',');
+
+            for (; i + 16 <= size; i += 16) {
+                __m128i chunk = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + i));
+                if (escaped ||
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, backslash))) {
+                    scan_scalar(data, i, i + 16, in_string, escaped);
+                    continue;
+                }
+
+                unsigned quotes = static_cast<unsigned>(
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote)));
+                __m128i braces =
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, open_brace),
+                                 _mm_cmpeq_epi8(chunk, close_brace));
+                __m128i brackets =
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, open_bracket),
+                                 _mm_cmpeq_epi8(chunk, close_bracket));
+                __m128i separators = _mm_or_si128(
+                    _mm_cmpeq_epi8(chunk, colon), _mm_cmpeq_epi8(chunk, comma));
+                unsigned structural = static_cast<unsigned>(
+                    _mm_movemask_epi8(_mm_or_si128(
+                        _mm_or_si128(braces, brackets), separators)));
+
+                // bit set for the opening quote and the bytes of a string
+                unsigned inside =
+                    prefix_xor(quotes) ^ (in_string ? 0xffffu : 0u);
+                in_string = (inside & 0x8000u) != 0;
+
+                unsigned bits = (structural & ~inside) | quotes;
+                while (bits != 0) {
+                    m_positions.push_back(
+                        static_cast<std::uint32_t>(i + trailing_zeros(bits)));
+                    bits &= bits - 1;
+                }
+            }
+#endif
+            scan_scalar(data, i, size, in_string, escaped);
+            if (in_string)
+                throw lua_exception("json: unterminated string");
+            count_elements(text);
+        }
+
+        const std::vector<std::uint32_t> &positions() const {
+            return m_positions;
+        }
+
+        // Elements of the array or object opened at structural k.
+        std::uint32_t count(std::size_t k) const {
+            return m_counts[k];
+        }
+
+      private:
+        std::vector<std::uint32_t> m_positions;
+        std::vector<std::uint32_t> m_counts;
+        std::vector<std::uint32_t> m_open;
+
+        static unsigned prefix_xor(unsigned x) {
+            x ^= x << 1;
+            x ^= x << 2;
+            x ^= x << 4;
+            x ^= x << 8;
+            return x & 0xffffu;
+        }
+
+        void scan_scalar(const char *data, std::size_t begin, std::size_t end,
+                         bool &in_string, bool &escaped) {
+            for (std::size_t i = begin; i < end; ++i) {
+                char c = data[i];
+                if (in_string) {
+                    if (escaped) {
+                        escaped = false;
+                    } else if (c == '\\') {
+                        escaped = true;
+                    } else if (c == '"') {
+                        m_positions.push_back(static_cast<std::uint32_t>(i));
+                        in_string = false;
+                    }
+                    continue;
+                }
+                switch (c) {
+                    case '"':
+                        in_string = true;
+                        // fall through
+                    case '{':
+                    case '}':
+                    case '[':
+                    case ']':
+                    case ':':
+                    case ',':
+                        m_positions.push_back(static_cast<std::uint32_t>(i));
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+
+        static bool blank(std::string_view text, std::size_t begin,
+                          std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) {
+                char c = text[i];
+                if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+                    return false;
+            }
+            return true;
+        }
+
+        void count_elements(std::string_view text) {
+            std::size_t n = m_positions.size();
+            m_counts.assign(n, 0);
+            m_open.clear();
+            for (std::size_t k = 0; k < n; ++k) {
+                char c = text[m_positions[k]];
+                if (c == '{' || c == '[') {
+                    m_open.push_back(static_cast<std::uint32_t>(k));
+                    m_counts[k] = 1;
+                } else if (c == ',') {
+                    if (!m_open.empty())
+                        ++m_counts[m_open.back()];
+                } else if (c == '}' || c == ']') {
+                    char opener = c == '}' ? '{' : '[';
+                    if (m_open.empty() ||
+                        text[m_positions[m_open.back()]] != opener)
+                        throw lua_exception("json: unbalanced brackets");
+                    std::uint32_t open = m_open.back();
+                    m_open.pop_back();
+                    if (k == open + 1u &&
+                        blank(text, m_positions[open] + 1, m_positions[k]))
+                        m_counts[open] = 0;
+                }
+            }
+            if (!m_open.empty())
+                throw lua_exception("json: unbalanced brackets");
+        }
+    };
+
+    // Per-state buffers reused by every decode and encode.
+    struct json_buffers {
+        json_index index;
+        std::string scratch;
+        std::string output;
+    };
+
+    // Stage two: walks the structural index and builds the Lua value.
+    // JSON null becomes nil.
+    class json_decoder {
+      public:
+        static const int MAX_DEPTH = 256;
+
+        json_decoder(lua_State *L, std::string_view text, json_buffers &buffers)
+            : m_state(L)
+            , m_text(text)
+            , m_index(buffers.index)
+            , m_positions(buffers.index.positions())
+            , m_scratch(buffers.scratch)
+            , m_k(0)
+            , m_pos(0) {}
+
+        // Pushes the decoded document.
+        void decode() {
+            parse_value(0);
+            std::size_t end = skip_blank(m_pos);
+            if (end != m_text.size() || m_k != m_positions.size())
+                fail("trailing characters", end);
+        }
+
+      private:
+        lua_State *m_state;
+        std::string_view m_text;
+        const json_index &m_index;
+        const std::vector<std::uint32_t> &m_positions;
+        std::string &m_scratch;
+        std::size_t m_k;   // next structural
+        std::size_t m_pos; // first unconsumed byte
+
+        [[noreturn]] void fail(const char *what, std::size_t offset) {
+            throw lua_exception(std::string("json: ") + what +
+                                " at offset " + std::to_string(offset));
+        }
+
+        std::size_t skip_blank(std::size_t p) const {
+            while (p < m_text.size() &&
+                   (m_text[p] == ' ' || m_text[p] == '\t' ||
+                    m_text[p] == '\n' || m_text[p] == '\r'))
+                ++p;
+            return p;
+        }
+
+        // Next byte after whitespace, 0 at the end of the input.
+        char peek() const {
+            std::size_t p = skip_blank(m_pos);
+            return p < m_text.size() ? m_text[p] : '\0';
+        }
+
+        void expect(char c) {
+            std::size_t p = skip_blank(m_pos);
+            if (m_k >= m_positions.size() || m_positions[m_k] != p ||
+                m_text[p] != c) {
+                char what[] = "expected ' '";
+                what[10] = c;
+                fail(what, p);
+            }
+            m_pos = p + 1;
+            ++m_k;
+        }
+
+        void parse_value(int depth) {
+            if (depth >= MAX_DEPTH)
+                fail("nesting too deep", m_pos);
+            std::size_t p = skip_blank(m_pos);
+            if (p >= m_text.size())
+                fail("unexpected end of input", p);
+
+            char c = m_text[p];
+            if (c == '{' || c == '[' || c == '"') {
+                if (m_k >= m_positions.size() || m_positions[m_k] != p)
+                    fail("unexpected character", p);
+                if (c == '"') {
+                    parse_string();
+                } else {
+                    std::uint32_t count = m_index.count(m_k);
+                    m_pos = p + 1;
+                    ++m_k;
+                    luaL_checkstack(m_state, 3, "decoding json");
+                    if (c == '{')
+                        parse_object(count, depth);
+                    else
+                        parse_array(count, depth);
+                }
+                return;
+            }
+
+            std::size_t end =
+                m_k < m_positions.size() ? m_positions[m_k] : m_text.size();
+            std::size_t last = end;
+            while (last > p && (m_text[last - 1] == ' ' ||
+                                m_text[last - 1] == '\t' ||
+                                m_text[last - 1] == '\n' ||
+                                m_text[last - 1] == '\r'))
+                --last;
+            parse_scalar(m_text.substr(p, last - p), p);
+            m_pos = end;
+        }
+
+        void parse_object(std::uint32_t count, int depth) {
+            lua_createtable(m_state, 0, static_cast<int>(count));
+            if (count == 0) {
+                expect('}');
+                return;
+            }
+            for (;;) {
+                if (peek() != '"')
+                    fail("expected string key", skip_blank(m_pos));
+                parse_string();
+                expect(':');
+                parse_value(depth + 1);
+                lua_rawset(m_state, -3);
+                if (peek() == ',') {
+                    expect(',');
+                    continue;
+                }
+                expect('}');
+                return;
+            }
+        }
+
+        void parse_array(std::uint32_t count, int depth) {
+            lua_createtable(m_state, static_cast<int>(count), 0);
+            if (count == 0) {
+                expect(']');
+                return;
+            }
+            for (lua_Integer i = 1;; ++i) {
+                parse_value(depth + 1);
+                lua_rawseti(m_state, -2, i);
+                if (peek() == ',') {
+                    expect(',');
+                    continue;
+                }
+                expect(']');
+                return;
+            }
+        }
+
+        // m_k is the opening quote; the closing one is the next structural.
+        void parse_string() {
+            std::size_t open = m_positions[m_k];
+            std::size_t close = m_positions[m_k + 1];
+            m_k += 2;
+            m_pos = close + 1;
+
+            std::string_view raw = m_text.substr(open + 1, close - open - 1);
+            if (raw.find('\\') == std::string_view::npos) {
+                lua_pushlstring(m_state, raw.data(), raw.size());
+                return;
+            }
+            m_scratch.clear();
+            for (std::size_t i = 0; i < raw.size(); ++i) {
+                char c = raw[i];
+                if (c != '\\') {
+                    m_scratch += c;
+                    continue;
+                }
+                if (++i >= raw.size())
+                    fail("bad escape", open + 1 + i);
+                switch (raw[i]) {
+                    case '"':
+                    case '\\':
+                    case '/':
+                        m_scratch += raw[i];
+                        break;
+                    case 'b':
+                        m_scratch += '\b';
+                        break;
+                    case 'f':
+                        m_scratch += '\f';
+                        break;
+                    case 'n':
+                        m_scratch += '\n';
+                        break;
+                    case 'r':
+                        m_scratch += '\r';
+                        break;
+                    case 't':
+                        m_scratch += '\t';
+                        break;
+                    case 'u':
+                        i = unescape_unicode(raw, i, open + 1);
+                        break;
+                    default:
+                        fail("bad escape", open + 1 + i);
+                }
+            }
+            lua_pushlstring(m_state, m_scratch.data(), m_scratch.size());
+        }
+
+        std::uint32_t hex4(std::string_view raw, std::size_t at,
+                           std::size_t base) {
+            if (at + 4 > raw.size())
+                fail("bad unicode escape", base + at);
+            std::uint32_t code = 0;
+            for (std::size_t j = at; j < at + 4; ++j) {
+                char h = raw[j];
+                code <<= 4;
+                if (h >= '0' && h <= '9')
+                    code |= static_cast<std::uint32_t>(h - '0');
+                else if (h >= 'a' && h <= 'f')
+                    code |= static_cast<std::uint32_t>(h - 'a' + 10);
+                else if (h >= 'A' && h <= 'F')
+                    code |= static_cast<std::uint32_t>(h - 'A' + 10);
+                else
+                    fail("bad unicode escape", base + j);
+            }
+            return code;
+        }
+
+        // i is at the 'u'; returns the index of the last consumed byte.
+        std::size_t unescape_unicode(std::string_view raw, std::size_t i,
+                                     std::size_t base) {
+            std::uint32_t code = hex4(raw, i + 1, base);
+            i += 4;
+            if (code >= 0xd800 && code < 0xdc00 && i + 6 < raw.size() &&
+                raw.substr(i + 1, 2) == "\\u") {
+                std::uint32_t low = hex4(raw, i + 3, base);
+                if (low >= 0xdc00 && low < 0xe000) {
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    i += 6;
+                }
+            }
+            append_utf8(code);
+            return i;
+        }
+
+        void append_utf8(std::uint32_t code) {
+            if (code < 0x80) {
+                m_scratch += static_cast<char>(code);
+            } else if (code < 0x800) {
+                m_scratch += static_cast<char>(0xc0 | (code >> 6));
+                m_scratch += static_cast<char>(0x80 | (code & 0x3f));
+            } else if (code < 0x10000) {
+                m_scratch += static_cast<char>(0xe0 | (code >> 12));
+                m_scratch += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                m_scratch += static_cast<char>(0x80 | (code & 0x3f));
+            } else {
+                m_scratch += static_cast<char>(0xf0 | (code >> 18));
+                m_scratch += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+                m_scratch += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                m_scratch += static_cast<char>(0x80 | (code & 0x3f));
+            }
+        }
+
+        void parse_scalar(std::string_view token, std::size_t offset) {
+            if (token == "true") {
+                lua_pushboolean(m_state, 1);
+            } else if (token == "false") {
+                lua_pushboolean(m_state, 0);
+            } else if (token == "null") {
+                lua_pushnil(m_state);
+            } else if (starts_number(token)) {
+                parse_number(token, offset);
+            } else {
+                fail("unexpected character", offset);
+            }
+        }
+
+        // A digit, optionally after a minus; keeps from_chars from
+        // accepting "inf" and "nan".
+        static bool starts_number(std::string_view token) {
+            std::size_t first = !token.empty() && token[0] == '-' ? 1 : 0;
+            return first < token.size() && token[first] >= '0' &&
+                   token[first] <= '9';
+        }
+
+        void parse_number(std::string_view token, std::size_t offset) {
+            const char *first = token.data();
+            const char *last = first + token.size();
+            if (token.find_first_of(".eE") == std::string_view::npos) {
+                long long integer = 0;
+                auto result = std::from_chars(first, last, integer);
+                if (result.ec == std::errc() && result.ptr == last) {
+                    lua_pushinteger(m_state, static_cast<lua_Integer>(integer));
+                    return;
+                }
+                if (result.ec != std::errc::result_out_of_range)
+                    fail("bad number", offset);
+            }
+            double number = 0;
+            auto result = std::from_chars(first, last, number);
+            if (result.ec != std::errc() || result.ptr != last)
+                fail("bad number", offset);
+            lua_pushnumber(m_state, static_cast<lua_Number>(number));
+        }
+    };
+
+    // Serialises Lua values into a caller owned buffer, which keeps its
+    // capacity between documents. Tables whose keys are exactly 1..#t
+    // become arrays, other tables objects (empty tables encode as {}).
+    class json_encoder {
+      public:
+        static const int MAX_DEPTH = 128;
+
+        json_encoder(lua_State *L, std::string &out)
+            : m_state(L)
+            , m_out(out) {}
+
+        void encode(int index) {
+            encode_value(lua_absindex(m_state, index), 0);
+        }
+
+      private:
+        lua_State *m_state;
+        std::string &m_out;
+
+        void encode_value(int index, int depth) {
+            switch (lua_type(m_state, index)) {
+                case LUA_TNIL:
+                    m_out += "null";
+                    break;
+                case LUA_TBOOLEAN:
+                    m_out += lua_toboolean(m_state, index) ? "true" : "false";
+                    break;
+                case LUA_TNUMBER:
+                    encode_number(index);
+                    break;
+                case LUA_TSTRING: {
+                    std::size_t len = 0;
+                    const char *s = lua_tolstring(m_state, index, &len);
+                    encode_string(std::string_view(s, len));
+                    break;
+                }
+                case LUA_TTABLE:
+                    if (depth >= MAX_DEPTH)
+                        throw lua_exception("json: table nested too deeply");
+                    luaL_checkstack(m_state, 3, "encoding json");
+                    if (is_array(index))
+                        encode_array(index, depth);
+                    else
+                        encode_object(index, depth);
+                    break;
+                default:
+                    throw lua_exception(
+                        std::string("json: cannot encode a value of type ") +
+                        lua_typename(m_state, lua_type(m_state, index)));
+            }
+        }
+
+        void encode_number(int index) {
+            char digits[32];
+            std::to_chars_result result;
+            if (lua_isinteger(m_state, index)) {
+                result = std::to_chars(
+                    digits, digits + sizeof(digits),
+                    static_cast<long long>(lua_tointeger(m_state, index)));
+            } else {
+                double number =
+                    static_cast<double>(lua_tonumber(m_state, index));
+                if (!std::isfinite(number))
+                    throw lua_exception("json: cannot encode inf or nan");
+                result = std::to_chars(digits, digits + sizeof(digits), number);
+            }
+            m_out.append(digits, result.ptr);
+        }
+
+        void encode_string(std::string_view text) {
+            static const char hex[] = "0123456789abcdef";
+            m_out += '"';
+            std::size_t run = 0;
+            for (std::size_t i = 0; i < text.size(); ++i) {
+                unsigned char c = static_cast<unsigned char>(text[i]);
+                if (c >= 0x20 && c != '"' && c != '\\')
+                    continue;
+                m_out.append(text.data() + run, i - run);
+                run = i + 1;
+                switch (c) {
+                    case '"':
+                        m_out += "\\\"";
+                        break;
+                    case '\\':
+                        m_out += "\\\\";
+                        break;
+                    case '\n':
+                        m_out += "\\n";
+                        break;
+                    case '\r':
+                        m_out += "\\r";
+                        break;
+                    case '\t':
+                        m_out += "\\t";
+                        break;
+                    default:
+                        m_out += "\\u00";
+                        m_out += hex[c >> 4];
+                        m_out += hex[c & 0xf];
+                        break;
+                }
+            }
+            m_out.append(text.data() + run, text.size() - run);
+            m_out += '"';
+        }
+
+        bool is_array(int index) {
+            lua_Integer length =
+                static_cast<lua_Integer>(lua_rawlen(m_state, index));
+            if (length == 0)
+                return false;
+            lua_Integer keys = 0;
+            lua_pushnil(m_state);
+            while (lua_next(m_state, index) != 0) {
+                lua_pop(m_state, 1);
+                if (!lua_isinteger(m_state, -1) ||
+                    lua_tointeger(m_state, -1) < 1 ||
+                    lua_tointeger(m_state, -1) > length) {
+                    lua_pop(m_state, 1);
+                    return false;
+                }
+                ++keys;
+            }
+            return keys == length;
+        }
+
+        void encode_array(int index, int depth) {
+            lua_Integer length =
+                static_cast<lua_Integer>(lua_rawlen(m_state, index));
+            m_out += '[';
+            for (lua_Integer i = 1; i <= length; ++i) {
+                if (i > 1)
+                    m_out += ',';
+                lua_rawgeti(m_state, index, i);
+                encode_value(lua_gettop(m_state), depth + 1);
+                lua_pop(m_state, 1);
+            }
+            m_out += ']';
+        }
+
+        void encode_object(int index, int depth) {
+            bool first = true;
+            m_out += '{';
+            lua_pushnil(m_state);
+            while (lua_next(m_state, index) != 0) {
+                if (!first)
+                    m_out += ',';
+                first = false;
+                int key_type = lua_type(m_state, -2);
+                if (key_type == LUA_TSTRING) {
+                    std::size_t len = 0;
+                    const char *s = lua_tolstring(m_state, -2, &len);
+                    encode_string(std::string_view(s, len));
+                } else if (key_type == LUA_TNUMBER) {
+                    m_out += '"';
+                    encode_number(lua_gettop(m_state) - 1);
+                    m_out += '"';
+                } else {
+                    lua_pop(m_state, 2);
+                    throw lua_exception(
+                        std::string("json: cannot encode a key of type ") +
+                        lua_typename(m_state, key_type));
+                }
+                m_out += ':';
+                encode_value(lua_gettop(m_state), depth + 1);
+                lua_pop(m_state, 1);
+            }
+            m_out += '}';
+        }
+    };
+
+    // Decodes text and pushes the result onto L. Throws lua_exception on
+    // malformed input, leaving the stack as it was.
+    inline void json_decode(lua_State *L, std::string_view text) {
+        json_buffers &buffers = state_extension<json_buffers>(L);
+        int top = lua_gettop(L);
+        try {
+            buffers.index.build(text);
+            json_decoder(L, text, buffers).decode();
+        } catch (...) {
+            lua_settop(L, top);
+            throw;
+        }
+    }
+
+    // Encodes the value at index into the state's reusable output buffer;
+    // the view is valid until the next encode on this state.
+    inline std::string_view json_encode(lua_State *L, int index) {
+        json_buffers &buffers = state_extension<json_buffers>(L);
+        int top = lua_gettop(L);
+        buffers.output.clear();
+        try {
+            json_encoder(L, buffers.output).encode(index);
+        } catch (...) {
+            lua_settop(L, top);
+            throw;
+        }
+        return buffers.output;
+    }
+
+    inline int json_decode_function(lua_State *L) {
+        std::size_t len = 0;
+        const char *text = luaL_checklstring(L, 1, &len);
+        return translate_exceptions(L, [&]() {
+            json_decode(L, std::string_view(text, len));
+            return 1;
+        });
+    }
+
+    inline int json_encode_function(lua_State *L) {
+        luaL_checkany(L, 1);
+        return translate_exceptions(L, [&]() {
+            std::string_view out = json_encode(L, 1);
+            lua_pushlstring(L, out.data(), out.size());
+            return 1;
+        });
+    }
+
+    inline constexpr luaL_Reg json_functions[] = {
+        {"decode", json_decode_function},
+        {"encode", json_encode_function},
+        {nullptr, nullptr}};
+
+    // require("json") once registered with preload_module().
+    inline constexpr module json_module = make_module("json", json_functions);
+
+};
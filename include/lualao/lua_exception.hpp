@@ -2,7 +2,15 @@
 #pragma once
 
 #include <exception>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "lualao/traceback.hpp"
 
 namespace lualao {
 
@@ -16,4 +24,113 @@ namespace lualao {
         virtual ~lua_exception() = default;
     };
 
+    // Thrown instead of lua_exception when Lua reports LUA_ERRMEM, e.g.
+    // because a state hit its memory limit.
+    class lua_memory_error: public lua_exception {
+      public:
+        lua_memory_error(const std::string &message)
+            : lua_exception(message) {}
+        lua_memory_error(const char *message)
+            : lua_exception(message) {}
+
+        virtual ~lua_memory_error() = default;
+    };
+
+    // Throws the exception matching a failed status from lua_load,
+    // lua_pcall and friends, using the error message on top of the stack
+    // (including its traceback, if the default handler captured one).
+    [[noreturn]] inline void throw_lua_error(lua_State *L, int status) {
+        const char *message = error_message(L, -1);
+        if (message == nullptr)
+            message = "(error object is not a string)";
+        if (status == LUA_ERRMEM)
+            throw lua_memory_error(message);
+        throw lua_exception(message);
+    }
+
+    // Runs f inside a lua_CFunction and turns any C++ exception into a Lua
+    // error. The message is pushed while the exception is still alive, but
+    // lua_error is only raised after every C++ object has been destroyed, so
+    // the longjmp never skips a destructor.
+    template <typename F>
+    int translate_exceptions(lua_State *L, F f) {
+        bool failed = false;
+        int results = 0;
+        try {
+            results = f();
+        } catch (const std::exception &e) {
+            lua_pushstring(L, e.what());
+            failed = true;
+        }
+        if (failed)
+            return lua_error(L);
+        return results;
+    }
+
+    namespace detail {
+        template <typename F>
+        struct protected_body {
+            F *body;
+            std::exception_ptr error;
+        };
+
+        template <typename F>
+        int run_protected_body(lua_State *L) {
+            protected_body<F> *context =
+                static_cast<protected_body<F> *>(lua_touserdata(L, 1));
+            lua_remove(L, 1);
+            bool failed = false;
+            try {
+                (*context->body)(L);
+            } catch (const std::exception &) {
+                context->error = std::current_exception();
+                failed = true;
+            }
+            if (failed) {
+                lua_settop(L, 0);
+                lua_pushnil(L);
+                return lua_error(L);
+            }
+            return lua_gettop(L);
+        }
+    };
+
+    // Runs body(L) as a lua_CFunction under lua_pcall, for host code that
+    // allocates in a state: without it a failed allocation (a state at its
+    // memory limit, say) or an error from a metamethod ends up in the
+    // panic handler and aborts. The top nargs values are passed to body as
+    // its stack; whatever body leaves there is returned, adjusted to
+    // nresults. Lua errors surface as lua_exception (lua_memory_error for
+    // LUA_ERRMEM) and C++ exceptions from body are rethrown as they are.
+    //
+    // body runs on a stack frame of its own, so indices of the caller's
+    // values are not valid in it; pass them as arguments. It must not keep
+    // C++ objects with destructors alive across Lua calls that may fail.
+    template <typename F>
+    void run_protected(lua_State *L, int nargs, int nresults, F &&body) {
+        typedef typename std::remove_reference<F>::type body_type;
+        detail::protected_body<body_type> context = {&body, nullptr};
+        if (!lua_checkstack(L, 2)) {
+            lua_pop(L, nargs);
+            throw lua_exception("stack overflow");
+        }
+        lua_pushcfunction(L, detail::run_protected_body<body_type>);
+        lua_pushlightuserdata(L, &context);
+        lua_rotate(L, -(nargs + 2), 2);
+        int status = lua_pcall(L, nargs + 1, nresults, 0);
+        if (status == LUA_OK)
+            return;
+        if (context.error) {
+            lua_pop(L, 1);
+            std::rethrow_exception(context.error);
+        }
+        std::string message = lua_type(L, -1) == LUA_TSTRING
+                                  ? lua_tostring(L, -1)
+                                  : "error in protected call";
+        lua_pop(L, 1);
+        if (status == LUA_ERRMEM)
+            throw lua_memory_error(message);
+        throw lua_exception(message);
+    }
+
 };
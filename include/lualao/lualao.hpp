@@ -18,8 +18,36 @@ extern "C" {
 #include "lualao/type_references/boolean_reference.hpp"
 
 #include "lualao/stack_context.hpp"
+#include "lualao/stack_tracker.hpp"
 #include "lualao/state.hpp"
+#include "lualao/standard_libraries.hpp"
+#include "lualao/value.hpp"
+#include "lualao/value_buffer.hpp"
+#include "lualao/channel.hpp"
+#include "lualao/stack_traits.hpp"
+#include "lualao/path.hpp"
+#include "lualao/chunk_cache.hpp"
+#include "lualao/mapped_file.hpp"
+#include "lualao/embedded_scripts.hpp"
+#include "lualao/sandbox.hpp"
+#include "lualao/checkpoint.hpp"
+#include "lualao/file_watcher.hpp"
+#include "lualao/reloader.hpp"
+#include "lualao/state_extension.hpp"
+#include "lualao/gc.hpp"
+#include "lualao/memory.hpp"
+#include "lualao/parallel.hpp"
+#include "lualao/script_compiler.hpp"
+#include "lualao/module.hpp"
+#include "lualao/shared_data.hpp"
+#include "lualao/config.hpp"
+#include "lualao/json.hpp"
+#include "lualao/csv.hpp"
+#include "lualao/string_builder.hpp"
+#include "lualao/metrics/call_metrics.hpp"
 
 #include "lualao/lua_exception.hpp"
+#include "lualao/call_result.hpp"
+#include "lualao/traceback.hpp"
 #include "lualao/stack_index.hpp"
 #include "lualao/type.hpp"
\ No newline at end of file
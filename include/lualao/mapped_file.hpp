@@ -0,0 +1,180 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#else
+    #include <cerrno>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/chunk_cache.hpp"
+#include "lualao/lua_exception.hpp"
+
+namespace lualao {
+
+    // Read-only view of a whole regular file mapped into memory. Move-only;
+    // the view is valid for the lifetime of the object. Empty files give an
+    // empty view without mapping anything. Anything that is not a regular
+    // file (pipes, devices, /proc entries) is rejected, since its size says
+    // nothing about its contents.
+    class mapped_file {
+      public:
+        explicit mapped_file(const std::string &path) {
+#ifdef _WIN32
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ,
+                                      FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                      FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                throw lua_exception("cannot open " + path);
+            if (GetFileType(file) != FILE_TYPE_DISK) {
+                CloseHandle(file);
+                throw lua_exception(path + " is not a regular file");
+            }
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file, &size)) {
+                CloseHandle(file);
+                throw lua_exception("cannot read " + path);
+            }
+            m_size = static_cast<std::size_t>(size.QuadPart);
+            if (m_size > 0) {
+                HANDLE mapping = CreateFileMappingA(file, nullptr,
+                                                   PAGE_READONLY, 0, 0,
+                                                   nullptr);
+                if (mapping != nullptr) {
+                    m_data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                    CloseHandle(mapping);
+                }
+            }
+            CloseHandle(file);
+            if (m_size > 0 && m_data == nullptr)
+                throw lua_exception("cannot map " + path);
+#else
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                throw lua_exception("cannot open " + path + ": " +
+                                    std::strerror(errno));
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                ::close(fd);
+                throw lua_exception("cannot read " + path);
+            }
+            if (!S_ISREG(info.st_mode)) {
+                ::close(fd);
+                throw lua_exception(path + " is not a regular file");
+            }
+            m_size = static_cast<std::size_t>(info.st_size);
+            if (m_size > 0) {
+                void *p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    m_data = p;
+                    // read once, front to back
+                    madvise(p, m_size, MADV_SEQUENTIAL);
+                }
+            }
+            ::close(fd);
+            if (m_size > 0 && m_data == nullptr)
+                throw lua_exception("cannot map " + path);
+#endif
+        }
+
+        mapped_file(mapped_file &&other) noexcept
+            : m_data(other.m_data)
+            , m_size(other.m_size) {
+            other.m_data = nullptr;
+            other.m_size = 0;
+        }
+
+        mapped_file(const mapped_file &) = delete;
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        ~mapped_file() {
+            if (m_data == nullptr)
+                return;
+#ifdef _WIN32
+            UnmapViewOfFile(m_data);
+#else
+            munmap(m_data, m_size);
+#endif
+        }
+
+        std::string_view view() const {
+            return std::string_view(static_cast<const char *>(m_data),
+                                    m_data ? m_size : 0);
+        }
+
+        std::size_t size() const {
+            return m_size;
+        }
+
+        // Whether path names an existing regular file, i.e. something
+        // mapped_file can map.
+        static bool is_regular(const char *path) {
+#ifdef _WIN32
+            DWORD attributes = GetFileAttributesA(path);
+            return attributes != INVALID_FILE_ATTRIBUTES &&
+                   !(attributes &
+                     (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_DEVICE));
+#else
+            struct stat info;
+            return ::stat(path, &info) == 0 && S_ISREG(info.st_mode);
+#endif
+        }
+
+      private:
+        void *m_data = nullptr;
+        std::size_t m_size = 0;
+    };
+
+    // Drop-in for luaL_loadfilex: compiles the file straight out of a
+    // mapping, so lua_load gets the whole file as one block instead of
+    // stdio-sized pieces copied through a buffer. Like luaL_loadfilex it
+    // skips a UTF-8 BOM and a first line starting with '#', names the
+    // chunk "@path", and reports unreadable files as LUA_ERRFILE with the
+    // message on the stack. A null path (stdin) and paths that are not
+    // regular files are handed to luaL_loadfilex, which reads them as
+    // streams.
+    inline int load_mapped_file(lua_State *L, const char *path,
+                                const char *mode = nullptr) {
+        if (path == nullptr || !mapped_file::is_regular(path))
+            return luaL_loadfilex(L, path, mode);
+        std::string chunkname = std::string("@") + path;
+        try {
+            mapped_file file(path);
+            std::string_view chunk = file.view();
+            if (chunk.substr(0, 3) == "\xEF\xBB\xBF")
+                chunk.remove_prefix(3);
+            if (!chunk.empty() && chunk.front() == '#') {
+                // keep the newline so line numbers stay right
+                std::size_t eol = chunk.find('\n');
+                chunk.remove_prefix(eol == std::string_view::npos
+                                        ? chunk.size()
+                                        : eol);
+            }
+            return load_chunk(L, chunk, chunkname.c_str(), mode);
+        } catch (const lua_exception &e) {
+            lua_pushstring(L, e.what());
+            return LUA_ERRFILE;
+        }
+    }
+
+};
@@ -0,0 +1,124 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+extern "C" {
+#include "lua.h"
+}
+
+namespace lualao {
+
+    struct memory_stats {
+        std::size_t current;
+        std::size_t peak;
+        std::size_t total_allocated;
+        std::uint64_t allocations;
+        std::uint64_t failed_allocations;
+        std::size_t limit;
+    };
+
+    // Allocator state behind every lualao::state: counts the bytes the
+    // state holds, its peak, everything it ever allocated, and enforces an
+    // optional hard limit. An allocation that would cross the limit fails,
+    // which Lua turns into a regular memory error (lua_memory_error on the
+    // C++ side); shrinking and freeing never fail.
+    //
+    // Only the thread running the state updates the counters, so they are
+    // plain relaxed loads and stores; other threads may read them through
+    // stats() at any time.
+    class memory_accounting {
+      public:
+        memory_accounting()
+            : m_current(0)
+            , m_peak(0)
+            , m_total(0)
+            , m_allocations(0)
+            , m_failed(0)
+            , m_limit(0) {}
+
+        memory_accounting(const memory_accounting &) = delete;
+        memory_accounting &operator=(const memory_accounting &) = delete;
+
+        // 0 removes the limit.
+        void set_limit(std::size_t bytes) {
+            m_limit.store(bytes, std::memory_order_relaxed);
+        }
+
+        memory_stats stats() const {
+            memory_stats s;
+            s.current = m_current.load(std::memory_order_relaxed);
+            s.peak = m_peak.load(std::memory_order_relaxed);
+            s.total_allocated = m_total.load(std::memory_order_relaxed);
+            s.allocations = m_allocations.load(std::memory_order_relaxed);
+            s.failed_allocations = m_failed.load(std::memory_order_relaxed);
+            s.limit = m_limit.load(std::memory_order_relaxed);
+            return s;
+        }
+
+        // lua_Alloc; ud is the memory_accounting
+        static void *allocate(void *ud, void *ptr, std::size_t osize,
+                              std::size_t nsize) {
+            memory_accounting *m = static_cast<memory_accounting *>(ud);
+            // for new blocks osize is a type tag, not a size
+            std::size_t old = ptr ? osize : 0;
+            std::size_t current = m->m_current.load(std::memory_order_relaxed);
+
+            if (nsize == 0) {
+                std::free(ptr);
+                m->m_current.store(current - old, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            std::size_t limit = m->m_limit.load(std::memory_order_relaxed);
+            if (nsize > old && limit != 0 && current - old + nsize > limit) {
+                m->bump(m->m_failed, 1);
+                return nullptr;
+            }
+
+            void *block = std::realloc(ptr, nsize);
+            if (block == nullptr) {
+                m->bump(m->m_failed, 1);
+                return nullptr;
+            }
+
+            current = current - old + nsize;
+            m->m_current.store(current, std::memory_order_relaxed);
+            if (nsize > old) {
+                m->bump(m->m_total, nsize - old);
+                if (current > m->m_peak.load(std::memory_order_relaxed))
+                    m->m_peak.store(current, std::memory_order_relaxed);
+            }
+            if (ptr == nullptr)
+                m->bump(m->m_allocations, 1);
+            return block;
+        }
+
+        // Finds the accounting of a state created by lualao::state, or
+        // nullptr for states using another allocator.
+        static memory_accounting *of(lua_State *L) {
+            void *ud;
+            if (lua_getallocf(L, &ud) != allocate)
+                return nullptr;
+            return static_cast<memory_accounting *>(ud);
+        }
+
+      private:
+        std::atomic<std::size_t> m_current;
+        std::atomic<std::size_t> m_peak;
+        std::atomic<std::size_t> m_total;
+        std::atomic<std::uint64_t> m_allocations;
+        std::atomic<std::uint64_t> m_failed;
+        std::atomic<std::size_t> m_limit;
+
+        template <typename T, typename U>
+        static void bump(std::atomic<T> &counter, U by) {
+            counter.store(counter.load(std::memory_order_relaxed) + by,
+                          std::memory_order_relaxed);
+        }
+    };
+
+};
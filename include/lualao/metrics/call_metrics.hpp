@@ -0,0 +1,196 @@
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "latency_histogram.hpp"
+
+namespace lualao {
+
+    // Counters for one named Lua entry point.
+    class call_stats {
+      public:
+        explicit call_stats(const std::string &name)
+            : m_name(name)
+            , m_errors(0) {}
+
+        const std::string &name() const {
+            return m_name;
+        }
+
+        void record(std::uint64_t nanoseconds, bool failed) {
+            m_latency.record(nanoseconds);
+            if (failed)
+                m_errors.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::uint64_t errors() const {
+            return m_errors.load(std::memory_order_relaxed);
+        }
+
+        histogram_snapshot latency() const {
+            return m_latency.snapshot();
+        }
+
+      private:
+        std::string m_name;
+        latency_histogram m_latency;
+        std::atomic<std::uint64_t> m_errors;
+    };
+
+    struct call_stats_snapshot {
+        std::string name;
+        std::uint64_t calls;
+        std::uint64_t errors;
+        histogram_snapshot latency;
+    };
+
+    // Process wide table of call_stats keyed by function name. Lookups and
+    // inserts are lock-free (open addressing over atomic pointers); entries
+    // are never removed, so a call_stats pointer stays valid for the life of
+    // the process. Names beyond CAPACITY share one overflow entry.
+    class call_metrics {
+      public:
+        static const std::size_t CAPACITY = 1024;
+
+        static call_metrics &instance() {
+            static call_metrics metrics;
+            return metrics;
+        }
+
+        call_stats *find_or_add(const char *name) {
+            std::size_t mask = CAPACITY - 1;
+            std::size_t slot = hash(name) & mask;
+            call_stats *fresh = nullptr;
+
+            for (std::size_t probe = 0; probe < CAPACITY; ++probe) {
+                std::atomic<call_stats *> &entry = m_slots[(slot + probe) & mask];
+                call_stats *current = entry.load(std::memory_order_acquire);
+                if (current == nullptr) {
+                    if (fresh == nullptr)
+                        fresh = new call_stats(name);
+                    if (entry.compare_exchange_strong(
+                            current, fresh, std::memory_order_acq_rel))
+                        return fresh;
+                }
+                if (current->name() == name) {
+                    delete fresh;
+                    return current;
+                }
+            }
+            delete fresh;
+            return &m_overflow;
+        }
+
+        std::vector<call_stats_snapshot> snapshot() const {
+            std::vector<call_stats_snapshot> result;
+            for (std::size_t i = 0; i < CAPACITY; ++i) {
+                if (call_stats *stats =
+                        m_slots[i].load(std::memory_order_acquire))
+                    result.push_back(snapshot_of(*stats));
+            }
+            if (m_overflow.latency().count > 0)
+                result.push_back(snapshot_of(m_overflow));
+            return result;
+        }
+
+        // Prometheus style text exposition of every function seen so far.
+        void write_text(std::ostream &out) const {
+            static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+            std::vector<call_stats_snapshot> all = snapshot();
+
+            out << "# TYPE lualao_call_latency_ns summary\n";
+            for (const auto &s : all) {
+                for (double q : quantiles)
+                    out << "lualao_call_latency_ns{function=\"" << s.name
+                        << "\",quantile=\"" << q << "\"} "
+                        << s.latency.percentile(q) << "\n";
+                out << "lualao_call_latency_ns_sum{function=\"" << s.name
+                    << "\"} " << s.latency.sum << "\n";
+                out << "lualao_call_latency_ns_count{function=\"" << s.name
+                    << "\"} " << s.calls << "\n";
+                out << "lualao_call_latency_ns_max{function=\"" << s.name
+                    << "\"} " << s.latency.max << "\n";
+            }
+            out << "# TYPE lualao_call_errors_total counter\n";
+            for (const auto &s : all)
+                out << "lualao_call_errors_total{function=\"" << s.name
+                    << "\"} " << s.errors << "\n";
+        }
+
+        call_metrics(const call_metrics &) = delete;
+        call_metrics &operator=(const call_metrics &) = delete;
+
+      private:
+        std::atomic<call_stats *> m_slots[CAPACITY];
+        call_stats m_overflow;
+
+        call_metrics()
+            : m_overflow("(overflow)") {
+            for (std::size_t i = 0; i < CAPACITY; ++i)
+                m_slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        ~call_metrics() {
+            for (std::size_t i = 0; i < CAPACITY; ++i)
+                delete m_slots[i].load(std::memory_order_relaxed);
+        }
+
+        static std::size_t hash(const char *name) {
+            // FNV-1a
+            std::uint64_t h = 14695981039346656037ull;
+            for (; *name; ++name) {
+                h ^= static_cast<unsigned char>(*name);
+                h *= 1099511628211ull;
+            }
+            return static_cast<std::size_t>(h);
+        }
+
+        static call_stats_snapshot snapshot_of(const call_stats &stats) {
+            call_stats_snapshot s;
+            s.name = stats.name();
+            s.latency = stats.latency();
+            s.calls = s.latency.count;
+            s.errors = stats.errors();
+            return s;
+        }
+    };
+
+    // Times one call and records it on destruction. Compiled in only when
+    // LUALAO_CALL_METRICS is defined; see function_reference::safeCall.
+    class call_timer {
+      public:
+        explicit call_timer(call_stats *stats)
+            : m_stats(stats)
+            , m_failed(false)
+            , m_start(std::chrono::steady_clock::now()) {}
+
+        ~call_timer() {
+            if (m_stats == nullptr)
+                return;
+            auto elapsed = std::chrono::steady_clock::now() - m_start;
+            m_stats->record(
+                static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        elapsed)
+                        .count()),
+                m_failed);
+        }
+
+        void failed() {
+            m_failed = true;
+        }
+
+      private:
+        call_stats *m_stats;
+        bool m_failed;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+};
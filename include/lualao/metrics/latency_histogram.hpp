@@ -0,0 +1,128 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lualao {
+
+    // Copy of a latency_histogram taken at one point in time.
+    struct histogram_snapshot {
+        std::uint64_t count = 0;
+        std::uint64_t sum = 0;
+        std::uint64_t max = 0;
+        std::vector<std::uint64_t> buckets;
+
+        // Lower bound of the bucket holding the p-th quantile (0 <= p <= 1).
+        std::uint64_t percentile(double p) const;
+
+        double mean() const {
+            return count ? static_cast<double>(sum) / count : 0.0;
+        }
+    };
+
+    // Log-linear histogram: values below 2^SUB_BUCKET_BITS get a bucket
+    // each, above that every power of two is split into 2^SUB_BUCKET_BITS
+    // equal sub-buckets, which bounds the relative error to about 6%.
+    // Recording is a handful of relaxed atomic adds, so any number of
+    // threads can record into the same histogram without locking.
+    class latency_histogram {
+      public:
+        static const unsigned SUB_BUCKET_BITS = 4;
+        static const unsigned SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+        // covers values up to 2^40 (about 18 minutes in nanoseconds)
+        static const unsigned MAX_VALUE_BITS = 40;
+        static const std::size_t BUCKET_COUNT =
+            (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+        latency_histogram()
+            : m_count(0)
+            , m_sum(0)
+            , m_max(0) {
+            for (std::size_t i = 0; i < BUCKET_COUNT; ++i)
+                m_buckets[i].store(0, std::memory_order_relaxed);
+        }
+
+        latency_histogram(const latency_histogram &) = delete;
+        latency_histogram &operator=(const latency_histogram &) = delete;
+
+        void record(std::uint64_t value) {
+            m_buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+            m_count.fetch_add(1, std::memory_order_relaxed);
+            m_sum.fetch_add(value, std::memory_order_relaxed);
+            std::uint64_t seen = m_max.load(std::memory_order_relaxed);
+            while (value > seen &&
+                   !m_max.compare_exchange_weak(seen, value,
+                                                std::memory_order_relaxed)) {
+            }
+        }
+
+        histogram_snapshot snapshot() const {
+            histogram_snapshot s;
+            s.buckets.resize(BUCKET_COUNT);
+            for (std::size_t i = 0; i < BUCKET_COUNT; ++i)
+                s.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+            s.count = m_count.load(std::memory_order_relaxed);
+            s.sum = m_sum.load(std::memory_order_relaxed);
+            s.max = m_max.load(std::memory_order_relaxed);
+            return s;
+        }
+
+        static std::size_t bucket_of(std::uint64_t value) {
+            if (value < SUB_BUCKETS)
+                return static_cast<std::size_t>(value);
+            unsigned msb = highest_bit(value);
+            if (msb >= MAX_VALUE_BITS)
+                return BUCKET_COUNT - 1;
+            unsigned shift = msb - SUB_BUCKET_BITS;
+            return (shift + 1) * SUB_BUCKETS +
+                   static_cast<std::size_t>((value >> shift) &
+                                            (SUB_BUCKETS - 1));
+        }
+
+        static std::uint64_t bucket_lower_bound(std::size_t bucket) {
+            if (bucket < SUB_BUCKETS)
+                return bucket;
+            std::size_t shift = bucket / SUB_BUCKETS - 1;
+            std::uint64_t sub = bucket % SUB_BUCKETS;
+            return (SUB_BUCKETS + sub) << shift;
+        }
+
+      private:
+        std::atomic<std::uint64_t> m_buckets[BUCKET_COUNT];
+        std::atomic<std::uint64_t> m_count;
+        std::atomic<std::uint64_t> m_sum;
+        std::atomic<std::uint64_t> m_max;
+
+        static unsigned highest_bit(std::uint64_t v) {
+#if defined(__GNUC__)
+            return 63u - static_cast<unsigned>(__builtin_clzll(v));
+#else
+            unsigned bit = 0;
+            while (v >>= 1)
+                ++bit;
+            return bit;
+#endif
+        }
+    };
+
+    inline std::uint64_t histogram_snapshot::percentile(double p) const {
+        if (count == 0)
+            return 0;
+        if (p < 0)
+            p = 0;
+        if (p > 1)
+            p = 1;
+        std::uint64_t rank = static_cast<std::uint64_t>(p * (count - 1)) + 1;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < buckets.size(); ++i) {
+            seen += buckets[i];
+            if (seen >= rank)
+                return latency_histogram::bucket_lower_bound(i);
+        }
+        return max;
+    }
+
+};
@@ -0,0 +1,175 @@
+
+#pragma once
+
+#include <cstddef>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+
+namespace lualao {
+
+    // A named value exported by a module next to its functions.
+    struct module_constant {
+        enum kind_type { INTEGER, NUMBER, STRING, BOOLEAN };
+
+        const char *name;
+        kind_type kind;
+        lua_Integer integer_value;
+        lua_Number number_value;
+        const char *string_value;
+
+        static constexpr module_constant integer(const char *name,
+                                                 lua_Integer value) {
+            return module_constant{name, INTEGER, value, 0, nullptr};
+        }
+
+        static constexpr module_constant number(const char *name,
+                                                lua_Number value) {
+            return module_constant{name, NUMBER, 0, value, nullptr};
+        }
+
+        static constexpr module_constant string(const char *name,
+                                                const char *value) {
+            return module_constant{name, STRING, 0, 0, value};
+        }
+
+        static constexpr module_constant boolean(const char *name,
+                                                 bool value) {
+            return module_constant{name, BOOLEAN, value ? 1 : 0, 0, nullptr};
+        }
+
+        void push(lua_State *L) const {
+            switch (kind) {
+                case INTEGER:
+                    lua_pushinteger(L, integer_value);
+                    break;
+                case NUMBER:
+                    lua_pushnumber(L, number_value);
+                    break;
+                case STRING:
+                    lua_pushstring(L, string_value);
+                    break;
+                case BOOLEAN:
+                    lua_pushboolean(L, integer_value != 0);
+                    break;
+            }
+        }
+    };
+
+    // Empty function list for modules that only carry constants or
+    // submodules.
+    inline constexpr luaL_Reg no_functions[] = {{nullptr, nullptr}};
+
+    // Description of a native module, built at compile time from static
+    // arrays with make_module():
+    //
+    //     constexpr luaL_Reg vec_functions[] = {
+    //         {"add", vec_add}, {"dot", vec_dot}, {nullptr, nullptr}};
+    //     constexpr module_constant vec_constants[] = {
+    //         module_constant::integer("DIMENSIONS", 3)};
+    //     constexpr module vec = make_module("vec", vec_functions,
+    //                                        vec_constants);
+    //
+    // Every count is known up front, so opening the module is one presized
+    // lua_createtable plus luaL_setfuncs, with no per-entry string copies
+    // or rehashing. The arrays are referenced, not copied, and must have
+    // static storage duration.
+    struct module {
+        const char *name;
+        const luaL_Reg *functions; // terminated by {nullptr, nullptr}
+        int function_count;
+        const module_constant *constants;
+        int constant_count;
+        const module *submodules;
+        int submodule_count;
+
+        // Pushes a new table holding the module's contents.
+        void push(lua_State *L) const {
+            luaL_checkstack(L, 3, "opening module");
+            lua_createtable(L, 0,
+                            function_count + constant_count + submodule_count);
+            luaL_setfuncs(L, functions, 0);
+            for (int i = 0; i < constant_count; ++i) {
+                constants[i].push(L);
+                lua_setfield(L, -2, constants[i].name);
+            }
+            for (int i = 0; i < submodule_count; ++i) {
+                submodules[i].push(L);
+                lua_setfield(L, -2, submodules[i].name);
+            }
+        }
+    };
+
+    template <std::size_t F>
+    constexpr int count_functions(const luaL_Reg (&functions)[F]) {
+        int count = 0;
+        while (static_cast<std::size_t>(count) < F &&
+               functions[count].name != nullptr)
+            ++count;
+        return count;
+    }
+
+    template <std::size_t F>
+    constexpr module make_module(const char *name,
+                                 const luaL_Reg (&functions)[F]) {
+        return module{name, functions, count_functions(functions),
+                      nullptr, 0, nullptr, 0};
+    }
+
+    template <std::size_t F, std::size_t C>
+    constexpr module make_module(const char *name,
+                                 const luaL_Reg (&functions)[F],
+                                 const module_constant (&constants)[C]) {
+        return module{name, functions, count_functions(functions),
+                      constants, static_cast<int>(C), nullptr, 0};
+    }
+
+    template <std::size_t F, std::size_t C, std::size_t S>
+    constexpr module make_module(const char *name,
+                                 const luaL_Reg (&functions)[F],
+                                 const module_constant (&constants)[C],
+                                 const module (&submodules)[S]) {
+        return module{name, functions, count_functions(functions),
+                      constants, static_cast<int>(C),
+                      submodules, static_cast<int>(S)};
+    }
+
+    template <std::size_t F, std::size_t S>
+    constexpr module make_module(const char *name,
+                                 const luaL_Reg (&functions)[F],
+                                 const module (&submodules)[S]) {
+        return module{name, functions, count_functions(functions),
+                      nullptr, 0, submodules, static_cast<int>(S)};
+    }
+
+    inline int load_module(lua_State *L) {
+        const module *m =
+            static_cast<const module *>(lua_touserdata(L, lua_upvalueindex(1)));
+        m->push(L);
+        return 1;
+    }
+
+    // Registers m in package.preload, so the first require(m.name) builds
+    // the table and later ones get it from package.loaded. Needs the
+    // package library to be open. The description itself is copied into
+    // the loader, so m may be a temporary; the arrays it points to still
+    // have to be static.
+    inline void preload_module(lua_State *L, const module &m) {
+        run_protected(L, 0, 0, [&m](lua_State *P) {
+            lua_getglobal(P, "package");
+            if (!lua_istable(P, -1))
+                throw lua_exception("package library is not open");
+            lua_getfield(P, -1, "preload");
+            module *copy =
+                static_cast<module *>(lua_newuserdata(P, sizeof(module)));
+            *copy = m;
+            lua_pushcclosure(P, load_module, 1);
+            lua_setfield(P, -2, m.name);
+        });
+    }
+
+};
@@ -0,0 +1,319 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/stack_context.hpp"
+#include "lualao/stack_traits.hpp"
+#include "lualao/state.hpp"
+#include "lualao/concurrency/state_pool.hpp"
+
+namespace lualao {
+
+    // Number of elements handed to Lua per call by the parallel helpers.
+    const std::size_t DEFAULT_BATCH_SIZE = 256;
+
+    // Hands out batch numbers to the workers of one parallel call and lets
+    // a failing worker stop the others.
+    class batch_cursor {
+      private:
+        std::atomic<std::size_t> m_next;
+        std::atomic<bool> m_stopped;
+        std::size_t m_count;
+
+      public:
+        explicit batch_cursor(std::size_t count)
+            : m_next(0)
+            , m_stopped(false)
+            , m_count(count) {}
+
+        bool next(std::size_t &batch) {
+            if (m_stopped.load(std::memory_order_relaxed))
+                return false;
+            batch = m_next.fetch_add(1, std::memory_order_relaxed);
+            return batch < m_count;
+        }
+
+        void stop() {
+            m_stopped.store(true, std::memory_order_relaxed);
+        }
+    };
+
+    // Joins the threads started so far when it goes out of scope, so an
+    // exception while launching workers never destroys a joinable thread
+    // (which would call std::terminate).
+    class thread_joiner {
+      public:
+        explicit thread_joiner(std::vector<std::thread> &threads)
+            : m_threads(threads) {}
+
+        thread_joiner(const thread_joiner &) = delete;
+        thread_joiner &operator=(const thread_joiner &) = delete;
+
+        ~thread_joiner() {
+            for (auto &t : m_threads) {
+                if (t.joinable())
+                    t.join();
+            }
+        }
+
+      private:
+        std::vector<std::thread> &m_threads;
+    };
+
+    // Runs body(state &) on the first `workers` states of the pool, one
+    // thread each (the calling thread takes state 0). The first exception
+    // a worker throws is rethrown as it was once every worker has finished.
+    template <typename Body>
+    void run_on_pool(state_pool &pool, std::size_t workers,
+                     batch_cursor &cursor, Body body) {
+        std::exception_ptr error;
+        std::mutex error_lock;
+
+        auto guarded = [&](std::size_t w) {
+            try {
+                body(pool[w]);
+            } catch (...) {
+                cursor.stop();
+                std::lock_guard<std::mutex> lock(error_lock);
+                if (!error)
+                    error = std::current_exception();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        {
+            thread_joiner joiner(threads);
+            try {
+                threads.reserve(workers);
+                for (std::size_t w = 1; w < workers; ++w)
+                    threads.emplace_back(guarded, w);
+            } catch (...) {
+                // let the workers already running wind down, then rethrow
+                cursor.stop();
+                throw;
+            }
+            guarded(0);
+        }
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Pushes a closure that applies the global function `name` to a whole
+    // batch, so crossing the C/Lua boundary happens once per batch instead
+    // of once per element.
+    inline void push_batch_wrapper(lua_State *L, const char *source,
+                                   const std::string &name) {
+        int status = luaL_loadstring(L, source);
+        if (status != LUA_OK)
+            throw_lua_error(L, status);
+        if (lua_getglobal(L, name.c_str()) != LUA_TFUNCTION)
+            throw lua_exception("'" + name + "' is not a function");
+        status = lua_pcall(L, 1, 1, 0);
+        if (status != LUA_OK)
+            throw_lua_error(L, status);
+    }
+
+    inline void call_batch(lua_State *L, int nargs, int nresults) {
+        int status = lua_pcall(L, nargs, nresults, 0);
+        if (status != LUA_OK)
+            throw_lua_error(L, status);
+    }
+
+    const char *const MAP_BATCH_SOURCE = "local f = ...\n"
+                                         "return function(t, n)\n"
+                                         "  for i = 1, n do t[i] = f(t[i]) end\n"
+                                         "end\n";
+
+    const char *const REDUCE_BATCH_SOURCE =
+        "local f = ...\n"
+        "return function(acc, t, first, n)\n"
+        "  for i = first, n do acc = f(acc, t[i]) end\n"
+        "  return acc\n"
+        "end\n";
+
+    // output[i] = name(input[i]) for every i, computed by all states of the
+    // pool in batches. Output order always matches input order.
+    template <typename In, typename Out>
+    void parallel_map(state_pool &pool, const std::string &name,
+                      const In *input, Out *output, std::size_t count,
+                      std::size_t batch_size = DEFAULT_BATCH_SIZE) {
+        if (count == 0)
+            return;
+        if (batch_size == 0)
+            batch_size = DEFAULT_BATCH_SIZE;
+
+        std::size_t batches = (count + batch_size - 1) / batch_size;
+        batch_cursor cursor(batches);
+
+        run_on_pool(
+            pool, std::min(pool.size(), batches), cursor, [&](state &s) {
+                stack_context ctx(s);
+                run_protected(s, 0, 0, [&](lua_State *L) {
+                    if (!lua_checkstack(L, 6))
+                        throw lua_exception("stack overflow in parallel_map");
+
+                    push_batch_wrapper(L, MAP_BATCH_SOURCE, name);
+                    int wrapper = lua_gettop(L);
+                    lua_createtable(L, static_cast<int>(batch_size), 0);
+                    int table = lua_gettop(L);
+
+                    std::size_t batch;
+                    while (cursor.next(batch)) {
+                        std::size_t first = batch * batch_size;
+                        std::size_t n = std::min(batch_size, count - first);
+
+                        for (std::size_t i = 0; i < n; ++i) {
+                            stack_traits<In>::push(L, input[first + i]);
+                            lua_rawseti(L, table,
+                                        static_cast<lua_Integer>(i + 1));
+                        }
+
+                        lua_pushvalue(L, wrapper);
+                        lua_pushvalue(L, table);
+                        lua_pushinteger(L, static_cast<lua_Integer>(n));
+                        call_batch(L, 2, 0);
+
+                        for (std::size_t i = 0; i < n; ++i) {
+                            lua_rawgeti(L, table,
+                                        static_cast<lua_Integer>(i + 1));
+                            output[first + i] =
+                                stack_traits<Out>::get(L, -1);
+                            lua_pop(L, 1);
+                        }
+                    }
+                });
+            });
+    }
+
+    // Folds input with the binary global function `name`, which must be
+    // associative. Each batch is folded left to right, and the per-batch
+    // results are folded in batch order starting from init. The result
+    // therefore depends only on the input and batch_size, never on thread
+    // timing.
+    template <typename T>
+    T parallel_reduce(state_pool &pool, const std::string &name,
+                      const T *input, std::size_t count, T init,
+                      std::size_t batch_size = DEFAULT_BATCH_SIZE) {
+        if (count == 0)
+            return init;
+        if (batch_size == 0)
+            batch_size = DEFAULT_BATCH_SIZE;
+
+        std::size_t batches = (count + batch_size - 1) / batch_size;
+        std::unique_ptr<T[]> partials(new T[batches]);
+        batch_cursor cursor(batches);
+
+        run_on_pool(
+            pool, std::min(pool.size(), batches), cursor, [&](state &s) {
+                stack_context ctx(s);
+                run_protected(s, 0, 0, [&](lua_State *L) {
+                    if (!lua_checkstack(L, 7))
+                        throw lua_exception(
+                            "stack overflow in parallel_reduce");
+
+                    push_batch_wrapper(L, REDUCE_BATCH_SOURCE, name);
+                    int wrapper = lua_gettop(L);
+                    lua_createtable(L, static_cast<int>(batch_size), 0);
+                    int table = lua_gettop(L);
+
+                    std::size_t batch;
+                    while (cursor.next(batch)) {
+                        std::size_t first = batch * batch_size;
+                        std::size_t n = std::min(batch_size, count - first);
+
+                        for (std::size_t i = 0; i < n; ++i) {
+                            stack_traits<T>::push(L, input[first + i]);
+                            lua_rawseti(L, table,
+                                        static_cast<lua_Integer>(i + 1));
+                        }
+
+                        lua_pushvalue(L, wrapper);
+                        lua_rawgeti(L, table, 1);
+                        lua_pushvalue(L, table);
+                        lua_pushinteger(L, 2);
+                        lua_pushinteger(L, static_cast<lua_Integer>(n));
+                        call_batch(L, 4, 1);
+                        partials[batch] = stack_traits<T>::get(L, -1);
+                        lua_pop(L, 1);
+                    }
+                });
+            });
+
+        state &s = pool[0];
+        stack_context ctx(s);
+        T result;
+        run_protected(s, 0, 0, [&](lua_State *L) {
+            push_batch_wrapper(L, REDUCE_BATCH_SOURCE, name);
+            stack_traits<T>::push(L, init);
+            lua_createtable(L, static_cast<int>(batches), 0);
+            for (std::size_t i = 0; i < batches; ++i) {
+                stack_traits<T>::push(L, partials[i]);
+                lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+            }
+            lua_pushinteger(L, 1);
+            lua_pushinteger(L, static_cast<lua_Integer>(batches));
+            call_batch(L, 4, 1);
+            result = stack_traits<T>::get(L, -1);
+        });
+        return result;
+    }
+
+    // Container front ends: anything with data() and size(), e.g.
+    // std::vector, std::array or std::span.
+    template <typename InRange, typename OutRange>
+    auto parallel_map(state_pool &pool, const std::string &name,
+                      const InRange &input, OutRange &&output,
+                      std::size_t batch_size = DEFAULT_BATCH_SIZE)
+        -> decltype(input.data(), output.data(), void()) {
+        if (input.size() != output.size())
+            throw lua_exception(
+                "parallel_map input and output sizes differ");
+        parallel_map(pool, name, input.data(), output.data(), input.size(),
+                     batch_size);
+    }
+
+    template <typename InRange, typename OutRange>
+    auto parallel_map(const state_pool::factory &make,
+                      const std::string &name, const InRange &input,
+                      OutRange &&output,
+                      std::size_t batch_size = DEFAULT_BATCH_SIZE)
+        -> decltype(input.data(), output.data(), void()) {
+        state_pool pool(make);
+        parallel_map(pool, name, input, output, batch_size);
+    }
+
+    template <typename Range, typename T>
+    auto parallel_reduce(state_pool &pool, const std::string &name,
+                         const Range &input, T init,
+                         std::size_t batch_size = DEFAULT_BATCH_SIZE)
+        -> decltype(input.data(), T()) {
+        return parallel_reduce<T>(pool, name, input.data(), input.size(),
+                                  init, batch_size);
+    }
+
+    template <typename Range, typename T>
+    auto parallel_reduce(const state_pool::factory &make,
+                         const std::string &name, const Range &input, T init,
+                         std::size_t batch_size = DEFAULT_BATCH_SIZE)
+        -> decltype(input.data(), T()) {
+        state_pool pool(make);
+        return parallel_reduce(pool, name, input, init, batch_size);
+    }
+
+};
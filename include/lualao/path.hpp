@@ -0,0 +1,318 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/stack_traits.hpp"
+
+namespace lualao {
+
+    // One step of a path: a string key, or an integer key for segments that
+    // are all digits ("items.3").
+    struct path_key {
+        const char *data;
+        std::size_t size;
+        lua_Integer index;
+        bool is_index;
+    };
+
+    inline path_key string_path_key(const char *data, std::size_t size) {
+        path_key key = {data, size, 0, false};
+        return key;
+    }
+
+    // Key for a segment of a dotted path: all digits make an integer key,
+    // unless the number does not fit a lua_Integer, in which case the
+    // segment stays a string key.
+    inline path_key make_path_key(const char *data, std::size_t size) {
+        const lua_Integer max = std::numeric_limits<lua_Integer>::max();
+        path_key key = {data, size, 0, size > 0};
+        for (std::size_t i = 0; i < size; ++i) {
+            int digit = data[i] - '0';
+            if (digit < 0 || digit > 9 || key.index > (max - digit) / 10) {
+                key.index = 0;
+                key.is_index = false;
+                break;
+            }
+            key.index = key.index * 10 + digit;
+        }
+        return key;
+    }
+
+    // Registry key of a table, weak in its keys, mapping a table to the
+    // table that actually holds its contents. A checkpoint registers every
+    // table it tracks here, since their contents live in shadow tables.
+    inline void *path_redirects_key() {
+        static const char key = 0;
+        return const_cast<char *>(&key);
+    }
+
+    // Replaces [table, key] on top of the stack with [table, table[key]].
+    // Only raw gets are used: a miss is retried in the table registered
+    // under path_redirects_key(), if any; metamethods never run.
+    inline void path_step(lua_State *L) {
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, -3) != LUA_TNIL) {
+            lua_remove(L, -2);
+            return;
+        }
+        lua_pop(L, 1);
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, path_redirects_key()) ==
+            LUA_TTABLE) {
+            lua_pushvalue(L, -3);
+            if (lua_rawget(L, -2) == LUA_TTABLE) {
+                // [table, key, redirects, contents]
+                lua_replace(L, -2);
+                lua_insert(L, -2);
+                lua_rawget(L, -2);
+                lua_remove(L, -2);
+                return;
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+        lua_pushnil(L);
+    }
+
+    // Lazy chained lookup starting at the globals, as in
+    //
+    //   double size = L["Config"]["net"]["pool"]["size"].get<double>();
+    //
+    // Indexing only records keys; nothing touches the Lua state until the
+    // value is read, and reading walks the tables with raw gets and leaves
+    // the stack as it found it. The keys are not copied, so a proxy is meant
+    // to be used within the expression that built it; keep a lualao::path
+    // for lookups that are repeated. String keys always index by string
+    // (L["t"]["123"] reads t["123"]); use the integer overloads for integer
+    // keys.
+    class path_proxy {
+      public:
+        static const std::size_t MAX_DEPTH = 8;
+
+        path_proxy(lua_State *L, const char *key)
+            : m_state(L)
+            , m_size(0) {
+            append(string_path_key(key, std::strlen(key)));
+        }
+
+        path_proxy operator[](const char *key) const {
+            path_proxy next(*this);
+            next.append(string_path_key(key, std::strlen(key)));
+            return next;
+        }
+
+        path_proxy operator[](const std::string &key) const {
+            path_proxy next(*this);
+            next.append(string_path_key(key.c_str(), key.size()));
+            return next;
+        }
+
+        path_proxy operator[](lua_Integer index) const {
+            path_proxy next(*this);
+            path_key key = {nullptr, 0, index, true};
+            next.append(key);
+            return next;
+        }
+
+        path_proxy operator[](int index) const {
+            return (*this)[static_cast<lua_Integer>(index)];
+        }
+
+        // Pushes the value (nil when any step is missing or not a table)
+        // and returns its type. The walk runs protected, since creating
+        // the key strings allocates.
+        int push() const {
+            run_protected(m_state, 0, 1, [this](lua_State *L) { walk(L); });
+            return lua_type(m_state, -1);
+        }
+
+        int type() const {
+            int t = push();
+            lua_pop(m_state, 1);
+            return t;
+        }
+
+        bool exists() const {
+            return type() != LUA_TNIL;
+        }
+
+        // Reads the value, or returns fallback when it is nil.
+        template <typename T>
+        T get(T fallback = T()) const {
+            int top = lua_gettop(m_state);
+            if (push() != LUA_TNIL)
+                fallback = stack_traits<T>::get(m_state, -1);
+            lua_settop(m_state, top);
+            return fallback;
+        }
+
+      private:
+        lua_State *m_state;
+        path_key m_keys[MAX_DEPTH];
+        std::size_t m_size;
+
+        void walk(lua_State *L) const {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+            for (std::size_t i = 0; i < m_size; ++i) {
+                if (lua_type(L, -1) != LUA_TTABLE) {
+                    lua_pop(L, 1);
+                    lua_pushnil(L);
+                    return;
+                }
+                const path_key &key = m_keys[i];
+                if (key.is_index)
+                    lua_pushinteger(L, key.index);
+                else
+                    lua_pushlstring(L, key.data, key.size);
+                path_step(L);
+                lua_replace(L, -2);
+            }
+        }
+
+        void append(const path_key &key) {
+            if (m_size == MAX_DEPTH)
+                throw lua_exception("path is deeper than path_proxy allows");
+            m_keys[m_size++] = key;
+        }
+    };
+
+    // A dotted path ("Config.net.pool.size") parsed once and reusable with
+    // any number of states. On first use in a state its keys are created as
+    // Lua values and kept in the registry, so later lookups fetch them by
+    // integer index instead of rebuilding and re-hashing the key strings.
+    // The cache keeps a path's keys for the life of the state (a few
+    // strings per path), so paths are meant to be long-lived objects built
+    // once, not per lookup. Like path_proxy, evaluation uses raw gets and
+    // keeps the stack balanced.
+    class path {
+      public:
+        explicit path(const std::string &dotted)
+            : m_id(next_id()) {
+            std::size_t start = 0;
+            for (;;) {
+                std::size_t dot = dotted.find('.', start);
+                std::size_t end = dot == std::string::npos ? dotted.size()
+                                                           : dot;
+                if (end == start)
+                    throw lua_exception("invalid path '" + dotted + "'");
+                m_segments.push_back(dotted.substr(start, end - start));
+                if (dot == std::string::npos)
+                    break;
+                start = dot + 1;
+            }
+        }
+
+        virtual ~path() = default;
+
+        const std::vector<std::string> &segments() const {
+            return m_segments;
+        }
+
+        // Pushes the value (nil when any step is missing or not a table)
+        // and returns its type.
+        int push(lua_State *L) const {
+            if (!lua_checkstack(L, 5))
+                throw lua_exception("stack overflow while reading path");
+            push_keys(L);
+            int keys = lua_gettop(L);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+            for (std::size_t i = 0; i < m_segments.size(); ++i) {
+                if (lua_type(L, -1) != LUA_TTABLE) {
+                    lua_pop(L, 1);
+                    lua_pushnil(L);
+                    break;
+                }
+                lua_rawgeti(L, keys, static_cast<lua_Integer>(i + 1));
+                path_step(L);
+                lua_replace(L, -2);
+            }
+            lua_replace(L, keys);
+            return lua_type(L, -1);
+        }
+
+        int type(lua_State *L) const {
+            int t = push(L);
+            lua_pop(L, 1);
+            return t;
+        }
+
+        bool exists(lua_State *L) const {
+            return type(L) != LUA_TNIL;
+        }
+
+        template <typename T>
+        T get(lua_State *L, T fallback = T()) const {
+            int top = lua_gettop(L);
+            if (push(L) != LUA_TNIL)
+                fallback = stack_traits<T>::get(L, -1);
+            lua_settop(L, top);
+            return fallback;
+        }
+
+      private:
+        std::vector<std::string> m_segments;
+        lua_Integer m_id;
+
+        static lua_Integer next_id() {
+            static std::atomic<lua_Integer> counter(0);
+            return ++counter;
+        }
+
+        static void *cache_key() {
+            static const char key = 0;
+            return const_cast<char *>(&key);
+        }
+
+        // Pushes this path's key table, building it (and the per-state cache
+        // of key tables, keyed by path id) under a protected call on first
+        // use. Lookups with the keys already built do not allocate.
+        void push_keys(lua_State *L) const {
+            if (lua_rawgetp(L, LUA_REGISTRYINDEX, cache_key()) == LUA_TTABLE) {
+                if (lua_rawgeti(L, -1, m_id) == LUA_TTABLE) {
+                    lua_replace(L, -2);
+                    return;
+                }
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+            run_protected(L, 0, 1, [this](lua_State *P) { build_keys(P); });
+        }
+
+        void build_keys(lua_State *L) const {
+            if (lua_rawgetp(L, LUA_REGISTRYINDEX, cache_key()) !=
+                LUA_TTABLE) {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_pushvalue(L, -1);
+                lua_rawsetp(L, LUA_REGISTRYINDEX, cache_key());
+            }
+            if (lua_rawgeti(L, -1, m_id) != LUA_TTABLE) {
+                lua_pop(L, 1);
+                lua_createtable(L, static_cast<int>(m_segments.size()), 0);
+                for (std::size_t i = 0; i < m_segments.size(); ++i) {
+                    const std::string &s = m_segments[i];
+                    path_key key = make_path_key(s.c_str(), s.size());
+                    if (key.is_index)
+                        lua_pushinteger(L, key.index);
+                    else
+                        lua_pushlstring(L, s.data(), s.size());
+                    lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+                }
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, -3, m_id);
+            }
+            lua_replace(L, -2);
+        }
+    };
+
+};
@@ -0,0 +1,226 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/chunk_cache.hpp"
+#include "lualao/file_watcher.hpp"
+#include "lualao/lua_exception.hpp"
+#include "lualao/path.hpp"
+#include "lualao/state.hpp"
+
+namespace lualao {
+
+    // Reloads scripts into live states when their files change.
+    //
+    // A changed file is compiled once (through chunk_cache) and re-run in
+    // every state that loaded it, but inside a scratch _ENV that reads
+    // through to the globals. Afterwards the results are merged: functions
+    // replace the existing ones, including functions inside tables that
+    // already exist (Player.F), while existing data values are left alone
+    // and only new names are added. Finally the chunk's _ENV is pointed at
+    // the real globals, so the new functions see live data.
+    //
+    // Nothing happens in the background: poll() applies pending reloads on
+    // the calling thread, which makes the point between two calls where it
+    // is invoked the safe point. Top-level statements that mutate existing
+    // tables in place do run again.
+    class script_reloader {
+      public:
+        script_reloader()
+            : m_generation(0) {}
+
+        // Loads path into s (as state::load_file) and watches it.
+        void load_file(state s, const std::string &path) {
+            s.load_file(path);
+            m_files[m_watcher.watch(path)].push_back(s);
+        }
+
+        // Applies every pending reload and returns how many files changed.
+        // A file that fails to compile or run leaves its states untouched;
+        // the errors are reported together after all files were handled.
+        std::size_t poll() {
+            std::vector<std::string> changed = m_watcher.poll();
+            std::string errors;
+            for (const auto &file : changed) {
+                std::string source;
+                if (!read_file(file, source)) {
+                    errors += "cannot read " + file + "\n";
+                    continue;
+                }
+                for (auto &s : m_files[file]) {
+                    try {
+                        reload(s, file, source);
+                    } catch (const lua_exception &e) {
+                        errors += std::string(e.what()) + "\n";
+                    }
+                }
+            }
+            if (!changed.empty())
+                m_generation.fetch_add(1, std::memory_order_release);
+            if (!errors.empty())
+                throw lua_exception(errors);
+            return changed.size();
+        }
+
+        // Bumped after every poll() that reloaded something.
+        std::uint64_t generation() const {
+            return m_generation.load(std::memory_order_acquire);
+        }
+
+      private:
+        file_watcher m_watcher;
+        std::map<std::string, std::vector<state>> m_files;
+        std::atomic<std::uint64_t> m_generation;
+
+        static bool read_file(const std::string &file, std::string &out) {
+            std::ifstream in(file, std::ios::binary);
+            if (!in)
+                return false;
+            std::ostringstream buffer;
+            buffer << in.rdbuf();
+            out = buffer.str();
+            return true;
+        }
+
+        static void reload(state &s, const std::string &file,
+                           const std::string &source) {
+            static const char *const merge_source =
+                "local env, G = ...\n"
+                "local seen = {}\n"
+                "local function merge(dst, src)\n"
+                "  if seen[src] then return end\n"
+                "  seen[src] = true\n"
+                "  for k, v in next, src do\n"
+                "    local old = dst[k]\n"
+                "    if old == nil or type(v) == 'function' then\n"
+                "      dst[k] = v\n"
+                "    elseif type(v) == 'table' and type(old) == 'table' then\n"
+                "      merge(old, v)\n"
+                "    end\n"
+                "  end\n"
+                "end\n"
+                "merge(G, env)\n";
+
+            lua_State *L = s;
+            if (!lua_checkstack(L, 8))
+                throw lua_exception("stack overflow while reloading " + file);
+            int top = lua_gettop(L);
+            std::string chunkname = "@" + file;
+            if (chunk_cache::instance().load(L, source, chunkname.c_str()) !=
+                LUA_OK)
+                fail(L, top);
+
+            // the scratch tables, the run and the merge all allocate, so
+            // they happen under a protected call with the chunk as argument
+            run_protected(L, 1, 0, [](lua_State *P) {
+                const int chunk = 1;
+
+                // scratch _ENV reading through to the globals
+                lua_newtable(P);
+                int env = lua_gettop(P);
+                lua_createtable(P, 0, 1);
+                lua_rawgeti(P, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+                lua_setfield(P, -2, "__index");
+                lua_setmetatable(P, env);
+                lua_pushvalue(P, env);
+                lua_setupvalue(P, chunk, 1);
+
+                lua_pushvalue(P, chunk);
+                if (lua_pcall(P, 0, 0, 0) != LUA_OK)
+                    fail(P, env);
+
+                if (luaL_loadstring(P, merge_source) != LUA_OK)
+                    fail(P, env);
+                lua_pushvalue(P, env);
+                lua_rawgeti(P, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+                if (lua_pcall(P, 2, 0, 0) != LUA_OK)
+                    fail(P, env);
+
+                // the closures created by the chunk share its _ENV upvalue
+                lua_rawgeti(P, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+                lua_setupvalue(P, chunk, 1);
+                lua_settop(P, 0);
+            });
+        }
+
+        static void fail(lua_State *L, int top) {
+            const char *text = error_message(L, -1);
+            std::string message =
+                text ? text : "(error object is not a string)";
+            lua_settop(L, top);
+            throw lua_exception(message);
+        }
+    };
+
+    // Long-lived handle to a global function (or a dotted path such as
+    // "Player.F"). The function is kept in the registry, so fetching it is
+    // a single indexed get; when the reloader has reloaded anything since
+    // the handle last looked, it is resolved again and picks up the new
+    // version.
+    class function_handle {
+      public:
+        function_handle(state s, const std::string &name,
+                        const script_reloader *reloader = nullptr)
+            : m_state(s)
+            , m_name(name)
+            , m_path(name)
+            , m_reloader(reloader)
+            , m_generation(0)
+            , m_ref(LUA_NOREF) {
+            refresh();
+        }
+
+        function_handle(const function_handle &) = delete;
+        function_handle &operator=(const function_handle &) = delete;
+
+        virtual ~function_handle() {
+            luaL_unref(m_state, LUA_REGISTRYINDEX, m_ref);
+        }
+
+        // Pushes the current version of the function.
+        void push() {
+            if (m_reloader && m_reloader->generation() != m_generation)
+                refresh();
+            lua_rawgeti(m_state, LUA_REGISTRYINDEX, m_ref);
+        }
+
+        // Pushes the function and returns a reference to it, to be called
+        // like the ones returned by state::get_function.
+        function_reference get(const int input = 0, const int output = 0) {
+            push();
+            return function_reference(m_state.get_shared(),
+                                      lua_gettop(m_state), input, output,
+                                      m_name.c_str());
+        }
+
+      private:
+        state m_state;
+        std::string m_name;
+        path m_path;
+        const script_reloader *m_reloader;
+        std::uint64_t m_generation;
+        int m_ref;
+
+        void refresh() {
+            lua_State *L = m_state;
+            if (m_reloader)
+                m_generation = m_reloader->generation();
+            m_path.push(L);
+            luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+            m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    };
+
+};
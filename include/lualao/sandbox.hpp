@@ -0,0 +1,381 @@
+
+#pragma once
+
+#include <cstring>
+#include <map>
+#include <new>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/chunk_cache.hpp"
+#include "lualao/lua_exception.hpp"
+#include "lualao/state.hpp"
+
+namespace lualao {
+
+    // Globals that are safe to hand to untrusted scripts: no I/O (print
+    // writes to the host's stdout, so it is left out too), no code loading,
+    // no access to metatables of shared values.
+    inline const std::vector<std::string> &default_sandbox_globals() {
+        static const std::vector<std::string> names = {
+            "assert",   "error",       "ipairs",      "next",
+            "pairs",    "pcall",       "rawequal",    "rawlen",
+            "select",   "setmetatable", "tonumber",   "tostring",
+            "type",     "xpcall",      "_VERSION",    "coroutine",
+            "math",     "string",      "table",       "utf8",
+            "os.clock", "os.date",     "os.difftime", "os.time"};
+        return names;
+    }
+
+    // One per-request environment: a fresh _ENV table whose reads fall
+    // through to the sandbox's shared base. Everything a script assigns
+    // lands in this table and disappears with it. Move-only; releases its
+    // registry reference on destruction.
+    class environment {
+      public:
+        environment(state s, int env_ref)
+            : m_state(s)
+            , m_ref(env_ref) {}
+
+        environment(environment &&other)
+            : m_state(other.m_state)
+            , m_ref(other.m_ref) {
+            other.m_ref = LUA_NOREF;
+        }
+
+        environment(const environment &) = delete;
+        environment &operator=(const environment &) = delete;
+
+        virtual ~environment() {
+            luaL_unref(m_state, LUA_REGISTRYINDEX, m_ref);
+        }
+
+        // Pushes the environment table.
+        void push() {
+            lua_rawgeti(m_state, LUA_REGISTRYINDEX, m_ref);
+        }
+
+        // Runs source with this table as its _ENV. The compiled chunk is
+        // shared through chunk_cache, so running the same request script in
+        // many environments parses it once.
+        void run(std::string_view source,
+                 const std::string &chunkname = "=sandbox") {
+            lua_State *L = m_state;
+            int status =
+                chunk_cache::instance().load(L, source, chunkname.c_str());
+            if (status != LUA_OK)
+                throw_lua_error(L, status);
+            // a freshly loaded chunk owns its _ENV upvalue
+            bind_and_call(L, 0, true);
+        }
+
+        // Runs the function on top of the stack (below its nargs arguments)
+        // with this table as _ENV. The function must be a Lua function
+        // whose first upvalue is named _ENV (so compiled with debug info).
+        // The call runs a copy of the function that shares every other
+        // upvalue with it; the _ENV of the original, which the other
+        // functions of its chunk share, is left untouched. The copy is
+        // made on the first call and kept for as long as the function
+        // lives. Functions defined by a chunk run here already see this
+        // environment.
+        void run_function(int nargs = 0) {
+            bind_and_call(m_state, nargs, false);
+        }
+
+        // Looks up a function defined by a chunk run in this environment.
+        function_reference get_function(const std::string &name,
+                                        const int input = 0,
+                                        const int output = 0) {
+            lua_State *L = m_state;
+            push();
+            run_protected(L, 1, 1, [&name](lua_State *P) {
+                lua_getfield(P, 1, name.c_str());
+                lua_remove(P, 1);
+            });
+            return function_reference(m_state.get_shared(), lua_gettop(L),
+                                      input, output, name.c_str());
+        }
+
+      private:
+        state m_state;
+        int m_ref;
+
+        // Calls the function below the nargs arguments with this table as
+        // _ENV. Unless the function is fresh (owns its upvalues), the call
+        // goes to its cached copy, so the shared _ENV upvalue is never
+        // written.
+        void bind_and_call(lua_State *L, int nargs, bool fresh) {
+            int function = lua_gettop(L) - nargs;
+            if (!lua_checkstack(L, 6)) {
+                lua_settop(L, function - 1);
+                throw lua_exception("stack overflow in sandbox call");
+            }
+            const char *name = lua_getupvalue(L, function, 1);
+            bool has_env = name != nullptr && std::strcmp(name, "_ENV") == 0;
+            if (name != nullptr)
+                lua_pop(L, 1);
+            if (!has_env) {
+                lua_settop(L, function - 1);
+                throw lua_exception("function has no _ENV upvalue");
+            }
+            if (fresh) {
+                push();
+                lua_setupvalue(L, function, 1);
+                int status = pcall_with_traceback(L, nargs, LUA_MULTRET);
+                if (status != LUA_OK)
+                    throw_lua_error(L, status);
+                return;
+            }
+
+            replace_with_copy(L, function);
+            // [previous _ENV, copy, copy, args...]: every environment calls
+            // the same copy, so its _ENV is put back afterwards; nested
+            // calls of the function stay right and the copy does not keep
+            // this table alive
+            lua_getupvalue(L, function, 1);
+            lua_insert(L, function);
+            lua_pushvalue(L, function + 1);
+            lua_insert(L, function + 2);
+            push();
+            lua_setupvalue(L, function + 2, 1);
+            int status = pcall_with_traceback(L, nargs, LUA_MULTRET);
+            lua_pushvalue(L, function);
+            lua_setupvalue(L, function + 1, 1);
+            lua_remove(L, function);
+            lua_remove(L, function);
+            if (status != LUA_OK)
+                throw_lua_error(L, status);
+        }
+
+        // Registry key of the table, weak in its keys, mapping functions to
+        // their sandbox copies.
+        static void *copies_key() {
+            static const char key = 0;
+            return const_cast<char *>(&key);
+        }
+
+        // Replaces the Lua function at index with its copy: a closure of
+        // the same prototype, made once per function, whose upvalues 2..n
+        // are joined to the original's; upvalue 1 (_ENV) is the copy's own.
+        static void replace_with_copy(lua_State *L, int function) {
+            if (lua_rawgetp(L, LUA_REGISTRYINDEX, copies_key()) ==
+                LUA_TTABLE) {
+                lua_pushvalue(L, function);
+                if (lua_rawget(L, -2) == LUA_TFUNCTION) {
+                    lua_replace(L, function);
+                    lua_pop(L, 1);
+                    return;
+                }
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+
+            std::string bytecode;
+            lua_pushvalue(L, function);
+            int failed = lua_dump(L, write, &bytecode, 0);
+            lua_pop(L, 1);
+            try {
+                if (failed)
+                    throw lua_memory_error(
+                        "not enough memory to copy function for sandbox "
+                        "call");
+                lua_pushvalue(L, function);
+                run_protected(L, 1, 1, [&bytecode](lua_State *P) {
+                    make_copy(P, bytecode);
+                });
+            } catch (...) {
+                lua_settop(L, function - 1);
+                throw;
+            }
+            lua_replace(L, function);
+        }
+
+        // Body of the protected call in replace_with_copy: turns [function]
+        // into [copy] and records the copy.
+        static void make_copy(lua_State *L, const std::string &bytecode) {
+            lua_Debug ar;
+            lua_pushvalue(L, 1);
+            lua_getinfo(L, ">u", &ar);
+            int status = load_chunk(L, bytecode, "=sandbox", "b");
+            if (status != LUA_OK)
+                lua_error(L);
+            for (int i = 2; i <= ar.nups; ++i)
+                lua_upvaluejoin(L, 2, i, 1, i);
+
+            if (lua_rawgetp(L, LUA_REGISTRYINDEX, copies_key()) !=
+                LUA_TTABLE) {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_createtable(L, 0, 1);
+                lua_pushliteral(L, "k");
+                lua_setfield(L, -2, "__mode");
+                lua_setmetatable(L, -2);
+                lua_pushvalue(L, -1);
+                lua_rawsetp(L, LUA_REGISTRYINDEX, copies_key());
+            }
+            lua_pushvalue(L, 1);
+            lua_pushvalue(L, 2);
+            lua_rawset(L, -3);
+            lua_settop(L, 2);
+            lua_replace(L, 1);
+        }
+
+        // A failed allocation ends the dump instead of unwinding through
+        // lua_dump.
+        static int write(lua_State *, const void *p, std::size_t size,
+                         void *ud) {
+            try {
+                static_cast<std::string *>(ud)->append(
+                    static_cast<const char *>(p), size);
+            } catch (const std::bad_alloc &) {
+                return 1;
+            }
+            return 0;
+        }
+    };
+
+    // A shared, read-only base environment built once from a whitelist of
+    // globals of a warmed state. Tables in the whitelist ("string", "math")
+    // are exposed through read-only proxies so one request cannot patch a
+    // library for the next; "lib.name" entries expose single fields of a
+    // library. "_G" is never exposed.
+    //
+    // create() costs one table allocation: the new _ENV gets the cached
+    // metatable whose __index is the base.
+    class sandbox {
+      public:
+        explicit sandbox(state s, const std::vector<std::string> &whitelist =
+                                      default_sandbox_globals())
+            : m_state(s)
+            , m_base_ref(LUA_NOREF)
+            , m_meta_ref(LUA_NOREF) {
+            std::set<std::string> whole;
+            std::map<std::string, std::vector<std::string>> fields;
+            for (const auto &name : whitelist) {
+                std::size_t dot = name.find('.');
+                if (dot == std::string::npos)
+                    whole.insert(name);
+                else
+                    fields[name.substr(0, dot)].push_back(
+                        name.substr(dot + 1));
+            }
+            whole.erase("_G");
+
+            // built under a protected call, so running out of memory
+            // throws instead of reaching the panic handler
+            run_protected(m_state, 0, 0, [&](lua_State *L) {
+                if (!lua_checkstack(L, 8))
+                    throw lua_exception(
+                        "stack overflow while creating sandbox");
+
+                lua_newtable(L);
+                int base = lua_gettop(L);
+                for (const auto &name : whole) {
+                    if (lua_getglobal(L, name.c_str()) == LUA_TTABLE)
+                        push_readonly(L, lua_gettop(L));
+                    lua_setfield(L, base, name.c_str());
+                }
+                for (const auto &kv : fields) {
+                    if (whole.count(kv.first) ||
+                        lua_getglobal(L, kv.first.c_str()) != LUA_TTABLE) {
+                        lua_settop(L, base);
+                        continue;
+                    }
+                    int library = lua_gettop(L);
+                    lua_createtable(L, 0, static_cast<int>(kv.second.size()));
+                    for (const auto &field : kv.second) {
+                        lua_getfield(L, library, field.c_str());
+                        lua_setfield(L, -2, field.c_str());
+                    }
+                    push_readonly(L, lua_gettop(L));
+                    lua_setfield(L, base, kv.first.c_str());
+                    lua_settop(L, base);
+                }
+
+                // metatable shared by every environment
+                lua_createtable(L, 0, 2);
+                lua_pushvalue(L, base);
+                lua_setfield(L, -2, "__index");
+                lua_pushliteral(L, "sandboxed");
+                lua_setfield(L, -2, "__metatable");
+                m_meta_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+                m_base_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            });
+        }
+
+        sandbox(const sandbox &) = delete;
+        sandbox &operator=(const sandbox &) = delete;
+
+        virtual ~sandbox() {
+            luaL_unref(m_state, LUA_REGISTRYINDEX, m_meta_ref);
+            luaL_unref(m_state, LUA_REGISTRYINDEX, m_base_ref);
+        }
+
+        environment create() {
+            int ref = LUA_NOREF;
+            run_protected(m_state, 0, 0, [&](lua_State *L) {
+                lua_createtable(L, 0, 0);
+                lua_rawgeti(L, LUA_REGISTRYINDEX, m_meta_ref);
+                lua_setmetatable(L, -2);
+                ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            });
+            return environment(m_state, ref);
+        }
+
+        // Pushes the shared base table.
+        void push_base() {
+            lua_rawgeti(m_state, LUA_REGISTRYINDEX, m_base_ref);
+        }
+
+      private:
+        state m_state;
+        int m_base_ref;
+        int m_meta_ref;
+
+        static int readonly_newindex(lua_State *L) {
+            return luaL_error(L, "attempt to modify a read-only table");
+        }
+
+        static int readonly_next(lua_State *L) {
+            luaL_checktype(L, 1, LUA_TTABLE);
+            lua_settop(L, 2);
+            if (lua_next(L, 1))
+                return 2;
+            lua_pushnil(L);
+            return 1;
+        }
+
+        // __pairs: iterate the table behind the proxy
+        static int readonly_pairs(lua_State *L) {
+            lua_getmetatable(L, 1);
+            lua_pushcfunction(L, readonly_next);
+            lua_getfield(L, -2, "__index");
+            lua_pushnil(L);
+            return 3;
+        }
+
+        // Replaces the table at index with a read-only proxy of it.
+        static void push_readonly(lua_State *L, int index) {
+            lua_newtable(L);
+            lua_createtable(L, 0, 4);
+            lua_pushvalue(L, index);
+            lua_setfield(L, -2, "__index");
+            lua_pushcfunction(L, readonly_newindex);
+            lua_setfield(L, -2, "__newindex");
+            lua_pushcfunction(L, readonly_pairs);
+            lua_setfield(L, -2, "__pairs");
+            lua_pushliteral(L, "read-only");
+            lua_setfield(L, -2, "__metatable");
+            lua_setmetatable(L, -2);
+            lua_replace(L, index);
+        }
+    };
+
+};
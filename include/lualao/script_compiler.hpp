@@ -0,0 +1,255 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/chunk_cache.hpp"
+#include "lualao/lua_exception.hpp"
+#include "lualao/mapped_file.hpp"
+#include "lualao/parallel.hpp"
+#include "lualao/traceback.hpp"
+
+namespace lualao {
+
+    // One script compiled by script_compiler: its bytecode plus what it
+    // has to run after.
+    struct compiled_script {
+        std::string name;
+        std::string chunkname;
+        std::vector<std::string> dependencies;
+        std::string bytecode;
+    };
+
+    // Compiles many scripts at once for startup: every worker thread gets
+    // its own throwaway state, reads and parses its share of the scripts
+    // and dumps them to bytecode. The result comes back in dependency
+    // order and can be loaded into any number of states with
+    // load_compiled(), which then only has to undump.
+    class script_compiler {
+      public:
+        // strip drops debug information (line numbers, local names) from
+        // the bytecode, which makes it smaller but tracebacks poorer.
+        explicit script_compiler(bool strip = false)
+            : m_strip(strip) {}
+
+        // A script read from path when compile() runs. name is what other
+        // scripts list as a dependency.
+        void add_file(const std::string &name, const std::string &path,
+                      std::vector<std::string> dependencies = {}) {
+            add(name, "@" + path, path, std::string(), true,
+                std::move(dependencies));
+        }
+
+        // A script held in memory.
+        void add_source(const std::string &name, std::string source,
+                        std::vector<std::string> dependencies = {}) {
+            add(name, "=" + name, std::string(), std::move(source), false,
+                std::move(dependencies));
+        }
+
+        std::size_t size() const {
+            return m_pending.size();
+        }
+
+        // Compiles everything added so far on up to `threads` threads (0
+        // for one per core). Throws lua_exception for unknown or circular
+        // dependencies (before compiling anything) and for the first
+        // script that fails to read or parse.
+        std::vector<compiled_script> compile(std::size_t threads = 0) {
+            std::vector<std::size_t> order = dependency_order();
+            if (order.empty())
+                return {};
+
+            std::vector<compiled_script> compiled(m_pending.size());
+            if (threads == 0)
+                threads = std::thread::hardware_concurrency();
+            threads = std::max<std::size_t>(
+                1, std::min(threads, m_pending.size()));
+
+            batch_cursor cursor(m_pending.size());
+            std::exception_ptr error;
+            std::mutex error_lock;
+
+            // the first exception of any worker is kept and rethrown as it
+            // was once all of them have finished
+            auto work = [&]() {
+                lua_State *L = nullptr;
+                try {
+                    L = luaL_newstate();
+                    if (L == nullptr)
+                        throw lua_memory_error("cannot create Lua state");
+                    std::size_t i;
+                    while (cursor.next(i))
+                        compile_one(L, m_pending[i], compiled[i]);
+                } catch (...) {
+                    cursor.stop();
+                    std::lock_guard<std::mutex> lock(error_lock);
+                    if (!error)
+                        error = std::current_exception();
+                }
+                if (L != nullptr)
+                    lua_close(L);
+            };
+
+            std::vector<std::thread> workers;
+            {
+                thread_joiner joiner(workers);
+                try {
+                    workers.reserve(threads - 1);
+                    for (std::size_t t = 1; t < threads; ++t)
+                        workers.emplace_back(work);
+                } catch (...) {
+                    // let the workers already running wind down, then
+                    // rethrow
+                    cursor.stop();
+                    throw;
+                }
+                work();
+            }
+
+            if (error)
+                std::rethrow_exception(error);
+
+            std::vector<compiled_script> result;
+            result.reserve(compiled.size());
+            for (std::size_t i : order)
+                result.push_back(std::move(compiled[i]));
+            return result;
+        }
+
+      private:
+        struct pending_script {
+            std::string name;
+            std::string chunkname;
+            std::string path;
+            std::string source;
+            bool from_file;
+            std::vector<std::string> dependencies;
+        };
+
+        bool m_strip;
+        std::vector<pending_script> m_pending;
+
+        void add(const std::string &name, std::string chunkname,
+                 std::string path, std::string source, bool from_file,
+                 std::vector<std::string> dependencies) {
+            m_pending.push_back({name, std::move(chunkname), std::move(path),
+                                 std::move(source), from_file,
+                                 std::move(dependencies)});
+        }
+
+        void compile_one(lua_State *L, const pending_script &script,
+                         compiled_script &out) {
+            int status =
+                script.from_file
+                    ? load_mapped_file(L, script.path.c_str(), "t")
+                    : load_chunk(L, script.source, script.chunkname.c_str());
+            if (status != LUA_OK)
+                throw_lua_error(L, status);
+
+            out.name = script.name;
+            out.chunkname = script.chunkname;
+            out.dependencies = script.dependencies;
+            int failed = lua_dump(L, write, &out.bytecode, m_strip ? 1 : 0);
+            lua_pop(L, 1);
+            if (failed)
+                throw lua_memory_error("not enough memory to compile " +
+                                       script.chunkname);
+        }
+
+        // Positions of m_pending in an order where every script comes after
+        // its dependencies; otherwise scripts keep the order they were
+        // added in.
+        std::vector<std::size_t> dependency_order() const {
+            std::unordered_map<std::string, std::size_t> by_name;
+            for (std::size_t i = 0; i < m_pending.size(); ++i) {
+                if (!by_name.emplace(m_pending[i].name, i).second)
+                    throw lua_exception("script '" + m_pending[i].name +
+                                        "' added twice");
+            }
+
+            enum { UNVISITED, VISITING, DONE };
+            std::vector<int> marks(m_pending.size(), UNVISITED);
+            std::vector<std::size_t> order;
+            order.reserve(m_pending.size());
+
+            // iterative depth first search; the stack holds (script, next
+            // dependency to look at)
+            std::vector<std::pair<std::size_t, std::size_t>> stack;
+            for (std::size_t root = 0; root < m_pending.size(); ++root) {
+                if (marks[root] != UNVISITED)
+                    continue;
+                marks[root] = VISITING;
+                stack.push_back({root, 0});
+                while (!stack.empty()) {
+                    auto &top = stack.back();
+                    const pending_script &script = m_pending[top.first];
+                    if (top.second == script.dependencies.size()) {
+                        marks[top.first] = DONE;
+                        order.push_back(top.first);
+                        stack.pop_back();
+                        continue;
+                    }
+                    const std::string &dep = script.dependencies[top.second++];
+                    auto it = by_name.find(dep);
+                    if (it == by_name.end())
+                        throw lua_exception("script '" + script.name +
+                                            "' depends on unknown script '" +
+                                            dep + "'");
+                    if (marks[it->second] == VISITING)
+                        throw lua_exception("circular dependency between '" +
+                                            script.name + "' and '" + dep +
+                                            "'");
+                    if (marks[it->second] == UNVISITED) {
+                        marks[it->second] = VISITING;
+                        stack.push_back({it->second, 0});
+                    }
+                }
+            }
+            return order;
+        }
+
+        // A failed allocation ends the dump instead of unwinding through
+        // lua_dump.
+        static int write(lua_State *, const void *p, std::size_t size,
+                         void *ud) {
+            try {
+                static_cast<std::string *>(ud)->append(
+                    static_cast<const char *>(p), size);
+            } catch (const std::bad_alloc &) {
+                return 1;
+            }
+            return 0;
+        }
+    };
+
+    // Runs compiled scripts in L in the given (dependency) order, like
+    // state::load_file would run their sources. Throws on the first
+    // runtime error. The same scripts can be loaded into many states.
+    inline void load_compiled(lua_State *L,
+                              const std::vector<compiled_script> &scripts) {
+        for (const compiled_script &script : scripts) {
+            int status = load_chunk(L, script.bytecode,
+                                    script.chunkname.c_str(), "b");
+            if (status == LUA_OK)
+                status = pcall_with_traceback(L, 0, 0);
+            if (status != LUA_OK)
+                throw_lua_error(L, status);
+        }
+    }
+
+};
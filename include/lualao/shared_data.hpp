@@ -0,0 +1,551 @@
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/chunk_cache.hpp"
+#include "lualao/state.hpp"
+
+namespace lualao {
+
+    // An immutable copy of a Lua table tree (booleans, numbers, strings and
+    // nested tables) kept on the C++ side, so one large reference dataset
+    // can be read by any number of states on any number of threads without
+    // each of them holding its own copy.
+    //
+    // Build it once with from_lua() and expose it with push_shared_data();
+    // scripts see read-only userdata supporting indexing, # and pairs.
+    // Nothing is ever written after construction, so lookups take no locks;
+    // the only shared write is the reference count of the shared_ptr each
+    // handle holds. Strings are interned, so repeated keys are stored once.
+    class shared_data {
+      public:
+        struct value {
+            enum kind_type : std::uint8_t {
+                NIL,
+                BOOLEAN,
+                INTEGER,
+                NUMBER,
+                STRING,
+                TABLE
+            };
+
+            kind_type kind;
+            std::uint32_t length; // strings only
+            union {
+                bool boolean;
+                lua_Integer integer;
+                lua_Number number;
+                std::size_t offset; // into the string pool
+                std::uint32_t table;
+            };
+
+            value()
+                : kind(NIL)
+                , length(0)
+                , integer(0) {}
+        };
+
+        struct entry {
+            value key;
+            value val;
+        };
+
+        // Array part holds keys 1..#t (nil for holes), the rest sits in an
+        // open addressed hash with a power of two number of slots.
+        struct table {
+            std::vector<value> array;
+            std::vector<entry> slots;
+        };
+
+        // Nesting limit; also what stops a cyclic table from recursing
+        // forever.
+        static const int MAX_DEPTH = 64;
+
+        // Copies the table at index. Functions, userdata, threads and table
+        // keys cannot be shared: they throw lua_exception, or are left out
+        // when skip_unsupported is set.
+        static std::shared_ptr<const shared_data>
+        from_lua(lua_State *L, int index, bool skip_unsupported = false) {
+            if (lua_type(L, index) != LUA_TTABLE)
+                throw lua_exception("shared data must be built from a table");
+            std::shared_ptr<shared_data> data(new shared_data());
+            build_context context;
+            context.skip_unsupported = skip_unsupported;
+            int top = lua_gettop(L);
+            try {
+                data->copy_table(L, lua_absindex(L, index), 0, context);
+            } catch (...) {
+                lua_settop(L, top);
+                throw;
+            }
+            return data;
+        }
+
+        // Position in an array part of the given length for the key at
+        // index, or 0 when the key belongs to the hash part.
+        static std::size_t array_position(std::size_t length, lua_State *L,
+                                          int index) {
+            if (lua_type(L, index) != LUA_TNUMBER)
+                return 0;
+            int is_integer = 0;
+            lua_Integer i = lua_tointegerx(L, index, &is_integer);
+            if (!is_integer || i < 1 ||
+                static_cast<std::size_t>(i) > length)
+                return 0;
+            return static_cast<std::size_t>(i);
+        }
+
+        const table &get_table(std::uint32_t t) const {
+            return m_tables[t];
+        }
+
+        std::string_view string(const value &v) const {
+            return std::string_view(m_strings.data() + v.offset, v.length);
+        }
+
+        // Slot holding the key at key_index of L's stack, or -1.
+        std::ptrdiff_t find_slot(const table &t, lua_State *L,
+                                 int key_index) const {
+            if (t.slots.empty())
+                return -1;
+            value key;
+            std::string_view text;
+            if (!read_key(L, key_index, key, text))
+                return -1;
+            std::size_t mask = t.slots.size() - 1;
+            std::size_t slot = hash(key, text) & mask;
+            while (t.slots[slot].key.kind != value::NIL) {
+                if (same_key(t.slots[slot].key, key, text))
+                    return static_cast<std::ptrdiff_t>(slot);
+                slot = (slot + 1) & mask;
+            }
+            return -1;
+        }
+
+        // Value stored under the key at key_index, or nullptr.
+        const value *find(std::uint32_t t, lua_State *L, int key_index) const {
+            const table &tab = m_tables[t];
+            std::size_t position =
+                array_position(tab.array.size(), L, key_index);
+            if (position != 0)
+                return &tab.array[position - 1];
+            std::ptrdiff_t slot = find_slot(tab, L, key_index);
+            return slot < 0 ? nullptr : &tab.slots[slot].val;
+        }
+
+        // Bytes held by the copy, roughly.
+        std::size_t memory_usage() const {
+            std::size_t bytes = m_strings.capacity();
+            for (const table &t : m_tables)
+                bytes += sizeof(table) + t.array.capacity() * sizeof(value) +
+                         t.slots.capacity() * sizeof(entry);
+            return bytes;
+        }
+
+      private:
+        std::vector<table> m_tables;
+        std::string m_strings;
+
+        struct build_context {
+            std::unordered_map<std::string, std::size_t> interned;
+            bool skip_unsupported;
+        };
+
+        shared_data() = default;
+
+        static std::uint64_t mix(std::uint64_t x) {
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdull;
+            x ^= x >> 33;
+            return x;
+        }
+
+        static std::uint64_t hash(const value &key, std::string_view text) {
+            switch (key.kind) {
+                case value::STRING:
+                    return content_hash(text);
+                case value::INTEGER:
+                    return mix(static_cast<std::uint64_t>(key.integer));
+                case value::NUMBER: {
+                    std::uint64_t bits = 0;
+                    std::memcpy(&bits, &key.number,
+                                sizeof(key.number) < sizeof(bits)
+                                    ? sizeof(key.number)
+                                    : sizeof(bits));
+                    return mix(bits ^ 0x9e3779b97f4a7c15ull);
+                }
+                default:
+                    return key.boolean ? 1 : 2;
+            }
+        }
+
+        // Classifies a key on L's stack; float keys with an integral value
+        // are integer keys, as in Lua tables.
+        static bool read_key(lua_State *L, int index, value &key,
+                             std::string_view &text) {
+            switch (lua_type(L, index)) {
+                case LUA_TBOOLEAN:
+                    key.kind = value::BOOLEAN;
+                    key.boolean = lua_toboolean(L, index) != 0;
+                    return true;
+                case LUA_TNUMBER: {
+                    int is_integer = 0;
+                    lua_Integer i = lua_tointegerx(L, index, &is_integer);
+                    if (is_integer) {
+                        key.kind = value::INTEGER;
+                        key.integer = i;
+                    } else {
+                        key.kind = value::NUMBER;
+                        key.number = lua_tonumber(L, index);
+                    }
+                    return true;
+                }
+                case LUA_TSTRING: {
+                    std::size_t len = 0;
+                    const char *s = lua_tolstring(L, index, &len);
+                    key.kind = value::STRING;
+                    key.length = static_cast<std::uint32_t>(len);
+                    text = std::string_view(s, len);
+                    return true;
+                }
+                default:
+                    return false;
+            }
+        }
+
+        bool same_key(const value &stored, const value &key,
+                      std::string_view text) const {
+            if (stored.kind != key.kind)
+                return false;
+            switch (key.kind) {
+                case value::STRING:
+                    return stored.length == key.length &&
+                           string(stored) == text;
+                case value::INTEGER:
+                    return stored.integer == key.integer;
+                case value::NUMBER:
+                    return stored.number == key.number;
+                default:
+                    return stored.boolean == key.boolean;
+            }
+        }
+
+        std::size_t intern(std::string_view text,
+                           std::unordered_map<std::string, std::size_t>
+                               &interned) {
+            auto found = interned.find(std::string(text));
+            if (found != interned.end())
+                return found->second;
+            std::size_t offset = m_strings.size();
+            m_strings.append(text.data(), text.size());
+            interned.emplace(std::string(text), offset);
+            return offset;
+        }
+
+        // Unsupported values come back as nil when they are skipped.
+        value copy_value(lua_State *L, int index, int depth,
+                         build_context &context) {
+            value v;
+            switch (lua_type(L, index)) {
+                case LUA_TNIL:
+                    break;
+                case LUA_TNUMBER:
+                    if (lua_isinteger(L, index)) {
+                        v.kind = value::INTEGER;
+                        v.integer = lua_tointeger(L, index);
+                    } else {
+                        v.kind = value::NUMBER;
+                        v.number = lua_tonumber(L, index);
+                    }
+                    break;
+                case LUA_TTABLE:
+                    v.kind = value::TABLE;
+                    v.table = copy_table(L, lua_absindex(L, index), depth + 1,
+                                         context);
+                    break;
+                default: {
+                    std::string_view text;
+                    if (!read_key(L, index, v, text)) {
+                        if (context.skip_unsupported)
+                            break;
+                        throw lua_exception(
+                            std::string("cannot share a value of type ") +
+                            lua_typename(L, lua_type(L, index)));
+                    }
+                    if (v.kind == value::STRING)
+                        v.offset = intern(text, context.interned);
+                    break;
+                }
+            }
+            return v;
+        }
+
+        std::uint32_t
+        copy_table(lua_State *L, int index, int depth,
+                   build_context &context) {
+            if (depth >= MAX_DEPTH)
+                throw lua_exception("shared data nested too deeply");
+            if (!lua_checkstack(L, 3))
+                throw lua_exception("stack overflow while copying shared data");
+
+            std::uint32_t id = static_cast<std::uint32_t>(m_tables.size());
+            m_tables.emplace_back();
+
+            std::size_t length = lua_rawlen(L, index);
+            std::vector<value> array(length);
+            for (std::size_t i = 0; i < length; ++i) {
+                lua_rawgeti(L, index, static_cast<lua_Integer>(i + 1));
+                array[i] = copy_value(L, -1, depth, context);
+                lua_pop(L, 1);
+            }
+
+            std::vector<entry> pairs;
+            lua_pushnil(L);
+            while (lua_next(L, index) != 0) {
+                if (array_position(length, L, -2) != 0) {
+                    lua_pop(L, 1);
+                    continue;
+                }
+                entry e;
+                std::string_view text;
+                if (read_key(L, -2, e.key, text)) {
+                    if (e.key.kind == value::STRING)
+                        e.key.offset = intern(text, context.interned);
+                    e.val = copy_value(L, -1, depth, context);
+                    if (e.val.kind != value::NIL)
+                        pairs.push_back(e);
+                } else if (!context.skip_unsupported) {
+                    throw lua_exception(
+                        std::string("cannot share a key of type ") +
+                        lua_typename(L, lua_type(L, -2)));
+                }
+                lua_pop(L, 1);
+            }
+
+            std::vector<entry> slots;
+            if (!pairs.empty()) {
+                std::size_t capacity = 1;
+                while (capacity < pairs.size() * 2)
+                    capacity <<= 1;
+                slots.resize(capacity);
+                for (const entry &e : pairs) {
+                    std::size_t slot =
+                        hash(e.key, e.key.kind == value::STRING
+                                        ? string(e.key)
+                                        : std::string_view()) &
+                        (capacity - 1);
+                    while (slots[slot].key.kind != value::NIL)
+                        slot = (slot + 1) & (capacity - 1);
+                    slots[slot] = e;
+                }
+            }
+
+            m_tables[id].array = std::move(array);
+            m_tables[id].slots = std::move(slots);
+            return id;
+        }
+    };
+
+    // Userdata seen by scripts: one table of a shared_data tree.
+    struct shared_table_handle {
+        std::shared_ptr<const shared_data> data;
+        std::uint32_t table;
+
+        static constexpr const char *METATABLE = "lualao.shared_table";
+    };
+
+    inline void
+    push_shared_table(lua_State *L,
+                      const std::shared_ptr<const shared_data> &data,
+                      std::uint32_t table);
+
+    inline shared_table_handle *check_shared_table(lua_State *L, int index) {
+        return static_cast<shared_table_handle *>(
+            luaL_checkudata(L, index, shared_table_handle::METATABLE));
+    }
+
+    inline void push_shared_value(lua_State *L, const shared_table_handle &h,
+                                  const shared_data::value &v) {
+        switch (v.kind) {
+            case shared_data::value::NIL:
+                lua_pushnil(L);
+                break;
+            case shared_data::value::BOOLEAN:
+                lua_pushboolean(L, v.boolean);
+                break;
+            case shared_data::value::INTEGER:
+                lua_pushinteger(L, v.integer);
+                break;
+            case shared_data::value::NUMBER:
+                lua_pushnumber(L, v.number);
+                break;
+            case shared_data::value::STRING: {
+                std::string_view text = h.data->string(v);
+                lua_pushlstring(L, text.data(), text.size());
+                break;
+            }
+            case shared_data::value::TABLE:
+                push_shared_table(L, h.data, v.table);
+                break;
+        }
+    }
+
+    inline int shared_table_index(lua_State *L) {
+        shared_table_handle *h = check_shared_table(L, 1);
+        const shared_data::value *v = h->data->find(h->table, L, 2);
+        if (v == nullptr)
+            lua_pushnil(L);
+        else
+            push_shared_value(L, *h, *v);
+        return 1;
+    }
+
+    inline int shared_table_newindex(lua_State *L) {
+        return luaL_error(L, "attempt to modify shared read-only data");
+    }
+
+    inline int shared_table_len(lua_State *L) {
+        shared_table_handle *h = check_shared_table(L, 1);
+        lua_pushinteger(L, static_cast<lua_Integer>(
+                               h->data->get_table(h->table).array.size()));
+        return 1;
+    }
+
+    // next() for shared tables: the array part in order, then the hash
+    // slots; each step finds its position from the previous key in O(1).
+    inline int shared_table_next(lua_State *L) {
+        shared_table_handle *h = check_shared_table(L, 1);
+        const shared_data::table &t = h->data->get_table(h->table);
+        lua_settop(L, 2);
+
+        std::size_t position = 0; // index into array part, then slots
+        if (!lua_isnil(L, 2)) {
+            position = shared_data::array_position(t.array.size(), L, 2);
+            if (position == 0) {
+                std::ptrdiff_t slot = h->data->find_slot(t, L, 2);
+                if (slot < 0)
+                    return luaL_error(L, "invalid key to 'next'");
+                position = t.array.size() + static_cast<std::size_t>(slot) + 1;
+            }
+        }
+
+        for (; position < t.array.size(); ++position) {
+            if (t.array[position].kind != shared_data::value::NIL) {
+                lua_pushinteger(L, static_cast<lua_Integer>(position + 1));
+                push_shared_value(L, *h, t.array[position]);
+                return 2;
+            }
+        }
+        for (std::size_t slot = position - t.array.size();
+             slot < t.slots.size(); ++slot) {
+            const shared_data::entry &e = t.slots[slot];
+            if (e.key.kind != shared_data::value::NIL) {
+                push_shared_value(L, *h, e.key);
+                push_shared_value(L, *h, e.val);
+                return 2;
+            }
+        }
+        lua_pushnil(L);
+        return 1;
+    }
+
+    inline int shared_table_pairs(lua_State *L) {
+        check_shared_table(L, 1);
+        lua_pushcfunction(L, shared_table_next);
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+        return 3;
+    }
+
+    inline int shared_table_gc(lua_State *L) {
+        static_cast<shared_table_handle *>(lua_touserdata(L, 1))
+            ->~shared_table_handle();
+        return 0;
+    }
+
+    // Registry key of the per-state cache of table handles: a table, weak
+    // in its values, keyed by the address of the shared_data::table each
+    // handle shows.
+    inline void *shared_table_cache_key() {
+        static const char key = 0;
+        return const_cast<char *>(&key);
+    }
+
+    // Pushes the handle of one table of data. While a handle is alive in L
+    // the same one is returned, so reading a subtable twice neither
+    // allocates nor copies the shared_ptr again, and handles compare equal.
+    inline void
+    push_shared_table(lua_State *L,
+                      const std::shared_ptr<const shared_data> &data,
+                      std::uint32_t table) {
+        const void *node = &data->get_table(table);
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, shared_table_cache_key()) !=
+            LUA_TTABLE) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_createtable(L, 0, 1);
+            lua_pushliteral(L, "v");
+            lua_setfield(L, -2, "__mode");
+            lua_setmetatable(L, -2);
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, shared_table_cache_key());
+        }
+        if (lua_rawgetp(L, -1, node) == LUA_TUSERDATA) {
+            lua_remove(L, -2);
+            return;
+        }
+        lua_pop(L, 1);
+
+        void *memory = lua_newuserdata(L, sizeof(shared_table_handle));
+        new (memory) shared_table_handle{data, table};
+        if (luaL_newmetatable(L, shared_table_handle::METATABLE)) {
+            static const luaL_Reg methods[] = {
+                {"__index", shared_table_index},
+                {"__newindex", shared_table_newindex},
+                {"__len", shared_table_len},
+                {"__pairs", shared_table_pairs},
+                {"__gc", shared_table_gc},
+                {nullptr, nullptr}};
+            luaL_setfuncs(L, methods, 0);
+            lua_pushliteral(L, "shared data");
+            lua_setfield(L, -2, "__metatable");
+        }
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, -3, node);
+        lua_remove(L, -2);
+    }
+
+    // Pushes the root table of data as read-only userdata.
+    inline void
+    push_shared_data(lua_State *L,
+                     const std::shared_ptr<const shared_data> &data) {
+        run_protected(L, 0, 1, [&data](lua_State *P) {
+            push_shared_table(P, data, 0);
+        });
+    }
+
+    inline void
+    register_shared_data(state &s, const std::string &name,
+                         const std::shared_ptr<const shared_data> &data) {
+        run_protected(s, 0, 0, [&](lua_State *P) {
+            push_shared_table(P, data, 0);
+            lua_setglobal(P, name.c_str());
+        });
+    }
+
+};
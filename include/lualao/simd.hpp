@@ -0,0 +1,29 @@
+
+#pragma once
+
+// SSE2 is part of every x86-64 target; the vectorised scanners (json,
+// csv) use it when available and fall back to scalar loops otherwise.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define LUALAO_SSE2
+    #include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+namespace lualao {
+
+    // Index of the lowest set bit; x must not be 0.
+    inline unsigned trailing_zeros(unsigned x) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, x);
+        return static_cast<unsigned>(index);
+#else
+        return static_cast<unsigned>(__builtin_ctz(x));
+#endif
+    }
+
+};
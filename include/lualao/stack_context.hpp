@@ -5,21 +5,63 @@
 #include "lua.h"
 #include <memory>
 #include "state.hpp"
+#include "stack_tracker.hpp"
 
 namespace lualao {
 
+    // Scoped stack usage: everything pushed inside the scope is popped when
+    // it ends. Passing the number of slots the scope expects to use reserves
+    // them up front with a single lua_checkstack instead of letting Lua grow
+    // the stack step by step (or overflow past LUA_MINSTACK).
+    //
+    // In debug builds the scope also tracks its peak depth and files it,
+    // together with the reservation, under name in stack_high_water.
     class stack_context {
       private:
         state m_state;
         int m_top;
+#ifdef _DEBUG
+        stack_scope m_scope;
+#endif
 
       public:
-        stack_context(state s)
+        stack_context(state s, int expected_slots = 0,
+                      const char *name = nullptr)
             : m_state(s) {
             m_top = lua_gettop(s);
+            if (expected_slots > 0)
+                m_state.reserve(expected_slots);
+#ifdef _DEBUG
+            m_scope.L = m_state;
+            m_scope.base = m_top;
+            m_scope.peak = 0;
+            m_scope.reserved = expected_slots;
+            m_scope.name = name;
+            m_scope.parent = current_stack_scope();
+            current_stack_scope() = &m_scope;
+#else
+            (void)name;
+#endif
         }
 
+        stack_context(const stack_context &) = delete;
+        stack_context &operator=(const stack_context &) = delete;
+
         ~stack_context() {
+#ifdef _DEBUG
+            observe_stack(m_state);
+            stack_high_water::instance().record(m_scope.name, m_scope.peak,
+                                                m_scope.reserved);
+            current_stack_scope() = m_scope.parent;
+            for (stack_scope *p = m_scope.parent; p; p = p->parent) {
+                if (p->L == m_scope.L) {
+                    int depth = m_scope.base - p->base + m_scope.peak;
+                    if (depth > p->peak)
+                        p->peak = depth;
+                    break;
+                }
+            }
+#endif
             int size = lua_gettop(m_state) - m_top;
             if (size > 0)
                 lua_pop(m_state, size);
@@ -28,8 +70,18 @@ namespace lualao {
         state get_state() {
             return m_state;
         }
+
+        // Peak depth seen by this scope so far (debug builds only, 0
+        // otherwise).
+        int peak() const {
+#ifdef _DEBUG
+            return m_scope.peak;
+#else
+            return 0;
+#endif
+        }
     };
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,32 +1,30 @@
-
 #pragma once
 
 namespace lualao {
-    // generic lua index
+    // generic lua index; a plain int wrapper, cheap to pass by value
     class stack_index {
         int index;
 
       public:
-        stack_index(int i)
+        constexpr stack_index(int i)
             : index(i) {}
-        virtual ~stack_index() = default;
 
-        bool is_from_top() {
+        constexpr bool is_from_top() const {
             return index < 0;
         }
 
-        bool is_from_bottom() {
+        constexpr bool is_from_bottom() const {
             return index > 0;
         }
 
-        operator int() {
+        constexpr operator int() const {
             return index;
         }
 
-        int get() {
+        constexpr int get() const {
             return index;
         }
     };
 
-    static stack_index STACK_TOP = stack_index(-1);
+    inline constexpr stack_index STACK_TOP = stack_index(-1);
 };
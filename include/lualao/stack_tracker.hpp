@@ -0,0 +1,94 @@
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+extern "C" {
+#include "lua.h"
+}
+
+namespace lualao {
+
+    // Debug builds (_DEBUG) track how deep each stack_context actually gets,
+    // so reservations can be sized from real data instead of guesses. The
+    // push/get paths of state and table_reference report the current depth
+    // to the innermost open scope of the same lua_State on this thread.
+
+    struct stack_scope {
+        lua_State *L;
+        int base;
+        int peak;
+        int reserved;
+        const char *name;
+        stack_scope *parent;
+    };
+
+    inline stack_scope *&current_stack_scope() {
+        static thread_local stack_scope *scope = nullptr;
+        return scope;
+    }
+
+    inline void observe_stack(lua_State *L) {
+#ifdef _DEBUG
+        for (stack_scope *s = current_stack_scope(); s; s = s->parent) {
+            if (s->L == L) {
+                int depth = lua_gettop(L) - s->base;
+                if (depth > s->peak)
+                    s->peak = depth;
+                return;
+            }
+        }
+#else
+        (void)L;
+#endif
+    }
+
+    // Peak depth per scope name across every scope closed so far.
+    class stack_high_water {
+      public:
+        struct entry {
+            int peak;
+            int reserved;
+            unsigned long scopes;
+        };
+
+        static stack_high_water &instance() {
+            static stack_high_water tracker;
+            return tracker;
+        }
+
+        void record(const char *name, int peak, int reserved) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            entry &e = m_entries[name ? name : "(unnamed)"];
+            if (peak > e.peak)
+                e.peak = peak;
+            if (reserved > e.reserved)
+                e.reserved = reserved;
+            ++e.scopes;
+        }
+
+        std::map<std::string, entry> snapshot() {
+            std::lock_guard<std::mutex> lock(m_lock);
+            return m_entries;
+        }
+
+        void report(std::ostream &out) {
+            for (const auto &kv : snapshot()) {
+                out << "stack scope '" << kv.first << "': peak "
+                    << kv.second.peak << ", reserved " << kv.second.reserved
+                    << ", scopes " << kv.second.scopes;
+                if (kv.second.peak > kv.second.reserved)
+                    out << " (reservation too small)";
+                out << "\n";
+            }
+        }
+
+      private:
+        std::mutex m_lock;
+        std::map<std::string, entry> m_entries;
+    };
+
+};
@@ -0,0 +1,77 @@
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+
+extern "C" {
+#include "lua.h"
+}
+
+namespace lualao {
+
+    // Moves C++ values on and off the Lua stack. Specialise for your own
+    // record types to use them with the generic helpers (parallel_map, ...):
+    //
+    //   template <> struct stack_traits<Player> {
+    //       static void push(lua_State *L, const Player &p);
+    //       static Player get(lua_State *L, int index);
+    //   };
+    template <typename T, typename Enable = void>
+    struct stack_traits;
+
+    template <>
+    struct stack_traits<bool> {
+        static void push(lua_State *L, bool v) {
+            lua_pushboolean(L, v);
+        }
+
+        static bool get(lua_State *L, int index) {
+            return lua_toboolean(L, index) != 0;
+        }
+    };
+
+    template <typename T>
+    struct stack_traits<T, typename std::enable_if<
+                               std::is_integral<T>::value &&
+                               !std::is_same<T, bool>::value>::type> {
+        static void push(lua_State *L, T v) {
+            lua_pushinteger(L, static_cast<lua_Integer>(v));
+        }
+
+        static T get(lua_State *L, int index) {
+            int isnum;
+            lua_Integer i = lua_tointegerx(L, index, &isnum);
+            if (!isnum)
+                return static_cast<T>(lua_tonumber(L, index));
+            return static_cast<T>(i);
+        }
+    };
+
+    template <typename T>
+    struct stack_traits<
+        T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+        static void push(lua_State *L, T v) {
+            lua_pushnumber(L, static_cast<lua_Number>(v));
+        }
+
+        static T get(lua_State *L, int index) {
+            return static_cast<T>(lua_tonumber(L, index));
+        }
+    };
+
+    template <>
+    struct stack_traits<std::string> {
+        static void push(lua_State *L, const std::string &v) {
+            lua_pushlstring(L, v.data(), v.size());
+        }
+
+        static std::string get(lua_State *L, int index) {
+            std::size_t len;
+            const char *s = lua_tolstring(L, index, &len);
+            return s ? std::string(s, len) : std::string();
+        }
+    };
+
+};
@@ -0,0 +1,193 @@
+
+#pragma once
+
+#include <cstring>
+
+extern "C" {
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+}
+
+namespace lualao {
+
+    // Standard libraries, combined into a mask for open_libraries() and
+    // state::open_libs().
+    enum library : unsigned {
+        LIB_BASE = 1u << 0,
+        LIB_PACKAGE = 1u << 1,
+        LIB_COROUTINE = 1u << 2,
+        LIB_TABLE = 1u << 3,
+        LIB_IO = 1u << 4,
+        LIB_OS = 1u << 5,
+        LIB_STRING = 1u << 6,
+        LIB_MATH = 1u << 7,
+        LIB_UTF8 = 1u << 8,
+        LIB_DEBUG = 1u << 9,
+        LIB_ALL = (1u << 10) - 1
+    };
+
+    struct library_entry {
+        unsigned bit;
+        const char *name;
+        lua_CFunction open;
+    };
+
+    // Same order as luaL_openlibs.
+    inline constexpr library_entry standard_libraries[] = {
+        {LIB_BASE, "_G", luaopen_base},
+        {LIB_PACKAGE, LUA_LOADLIBNAME, luaopen_package},
+        {LIB_COROUTINE, LUA_COLIBNAME, luaopen_coroutine},
+        {LIB_TABLE, LUA_TABLIBNAME, luaopen_table},
+        {LIB_IO, LUA_IOLIBNAME, luaopen_io},
+        {LIB_OS, LUA_OSLIBNAME, luaopen_os},
+        {LIB_STRING, LUA_STRLIBNAME, luaopen_string},
+        {LIB_MATH, LUA_MATHLIBNAME, luaopen_math},
+        {LIB_UTF8, LUA_UTF8LIBNAME, luaopen_utf8},
+        {LIB_DEBUG, LUA_DBLIBNAME, luaopen_debug}};
+
+    // Opens the libraries in mask right away, like luaL_openlibs does for
+    // all of them.
+    inline void open_libraries(lua_State *L, unsigned mask = LIB_ALL) {
+        for (const library_entry &entry : standard_libraries) {
+            if (mask & entry.bit) {
+                luaL_requiref(L, entry.name, entry.open, 1);
+                lua_pop(L, 1);
+            }
+        }
+    }
+
+    namespace detail {
+        inline int lazy_library_loader(lua_State *L);
+
+        // Points package.preload at the libraries still pending, so that
+        // require("string") materialises them too.
+        inline void preload_pending_libraries(lua_State *L, int pending) {
+            pending = lua_absindex(L, pending);
+            lua_getfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+            lua_pushnil(L);
+            while (lua_next(L, pending) != 0) {
+                bool waiting = lua_type(L, -1) == LUA_TFUNCTION;
+                lua_pop(L, 1);
+                if (!waiting)
+                    continue;
+                lua_pushvalue(L, -1);
+                lua_pushvalue(L, pending);
+                lua_pushcclosure(L, lazy_library_loader, 1);
+                lua_settable(L, -4);
+            }
+            lua_pop(L, 1);
+        }
+
+        // Opens the pending library name and pushes its table. pending
+        // maps the names of unopened libraries to their luaopen_ functions
+        // and those of opened ones to true; an opened library is pushed
+        // from package.loaded, so it is found again even after its global
+        // was removed (by a checkpoint rollback, say). Returns false, with
+        // nothing pushed, for other names.
+        inline bool materialise_library(lua_State *L, int pending,
+                                        const char *name) {
+            pending = lua_absindex(L, pending);
+            int type = lua_getfield(L, pending, name);
+            if (type == LUA_TBOOLEAN) {
+                lua_pop(L, 1);
+                lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+                lua_getfield(L, -1, name);
+                lua_remove(L, -2);
+                return true;
+            }
+            if (type != LUA_TFUNCTION) {
+                lua_pop(L, 1);
+                return false;
+            }
+            lua_CFunction open = lua_tocfunction(L, -1);
+            lua_pop(L, 1);
+            lua_pushboolean(L, 1);
+            lua_setfield(L, pending, name);
+
+            luaL_requiref(L, name, open, 1);
+            if (std::strcmp(name, LUA_LOADLIBNAME) == 0)
+                preload_pending_libraries(L, pending);
+            return true;
+        }
+
+        // __index of _G: a missing global that names a lazy library opens
+        // it (again, if its global is gone) and stores it raw in the table
+        // indexed.
+        inline int lazy_global_index(lua_State *L) {
+            if (lua_type(L, 2) != LUA_TSTRING ||
+                !materialise_library(L, lua_upvalueindex(1),
+                                     lua_tostring(L, 2)))
+                return 0;
+            lua_pushvalue(L, 2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, 1);
+            return 1;
+        }
+
+        // package.preload entry for a pending library.
+        inline int lazy_library_loader(lua_State *L) {
+            lua_settop(L, 1);
+            return materialise_library(L, lua_upvalueindex(1),
+                                       lua_tostring(L, 1))
+                       ? 1
+                       : 0;
+        }
+
+        // __index of the string metatable until the string library is
+        // opened; luaopen_string then installs the real metatable.
+        inline int lazy_string_index(lua_State *L) {
+            if (!materialise_library(L, lua_upvalueindex(1), LUA_STRLIBNAME))
+                return 0;
+            lua_pushvalue(L, 2);
+            lua_gettable(L, -2);
+            return 1;
+        }
+    };
+
+    // Like open_libraries, but only the base library is opened right away;
+    // the others are built the first time their global is read (or they
+    // are required), so states that never touch io or debug never pay for
+    // them. Method calls on strings open the string library as well.
+    //
+    // This installs a metatable on _G; scripts that replace it (strict
+    // mode modules, for instance) must open what they need first.
+    inline void open_libraries_lazily(lua_State *L, unsigned mask = LIB_ALL) {
+        open_libraries(L, mask & LIB_BASE);
+
+        lua_createtable(L, 0, 9);
+        int pending = lua_gettop(L);
+        for (const library_entry &entry : standard_libraries) {
+            if (entry.bit != LIB_BASE && (mask & entry.bit)) {
+                lua_pushcfunction(L, entry.open);
+                lua_setfield(L, pending, entry.name);
+            }
+        }
+
+        lua_pushglobaltable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushvalue(L, pending);
+        lua_pushcclosure(L, detail::lazy_global_index, 1);
+        lua_setfield(L, -2, "__index");
+        lua_setmetatable(L, -2);
+        lua_pop(L, 1);
+
+        if (mask & LIB_STRING) {
+            lua_pushliteral(L, "");
+            lua_createtable(L, 0, 1);
+            lua_pushvalue(L, pending);
+            lua_pushcclosure(L, detail::lazy_string_index, 1);
+            lua_setfield(L, -2, "__index");
+            lua_setmetatable(L, -2);
+            lua_pop(L, 1);
+        }
+
+        // with package requested, it is opened now: require has to be
+        // callable as a plain global, and it brings the preloads along
+        if ((mask & LIB_PACKAGE) &&
+            detail::materialise_library(L, pending, LUA_LOADLIBNAME))
+            lua_pop(L, 1);
+        lua_pop(L, 1);
+    }
+
+};
@@ -6,6 +6,7 @@
 #include <string>
 #include <iostream>
 #include <functional>
+#include <string_view>
 
 extern "C" {
 #include "lua.h"
@@ -14,7 +15,18 @@ extern "C" {
 };
 
 #include "stack_index.hpp"
+#include "stack_tracker.hpp"
 #include "lua_exception.hpp"
+#include "call_result.hpp"
+#include "traceback.hpp"
+#include "path.hpp"
+#include "chunk_cache.hpp"
+#include "mapped_file.hpp"
+#include "gc.hpp"
+#include "memory.hpp"
+#include "value.hpp"
+#include "json.hpp"
+#include "standard_libraries.hpp"
 
 #include "type_references/boolean_reference.hpp"
 #include "type_references/function_reference.hpp"
@@ -24,10 +36,22 @@ extern "C" {
 
 namespace lualao {
 
+    // Calls that allocate in the state (pushing strings, reading globals,
+    // captures, JSON) run under a protected call, so a state at its memory
+    // limit fails them with lua_memory_error instead of reaching panic().
     class state {
       public:
+        // Like luaL_newstate, but allocating through a memory_accounting
+        // owned by the state (see memory() and set_memory_limit()).
         state() {
-            m_state = std::shared_ptr<lua_State>(luaL_newstate(), lua_close);
+            memory_accounting *accounting = new memory_accounting();
+            lua_State *L = lua_newstate(memory_accounting::allocate, accounting);
+            if (L == nullptr) {
+                delete accounting;
+                throw lua_memory_error("cannot create Lua state");
+            }
+            lua_atpanic(L, panic);
+            m_state = std::shared_ptr<lua_State>(L, close);
         }
 
         state(std::shared_ptr<lua_State> p) {
@@ -40,91 +64,194 @@ namespace lualao {
             return m_state.get();
         }
 
+        std::shared_ptr<lua_State> get_shared() const {
+            return m_state;
+        }
+
         bool check_error(int return_code) {
             if (return_code != LUA_OK) {
-                std::string errormsg = lua_tostring(m_state.get(), -1);
-                std::cerr << errormsg << std::endl;
+                // error_message formats a captured traceback; a plain
+                // lua_tostring would see the error_trace userdata
+                const char *errormsg = error_message(m_state.get(), -1);
+                std::cerr << (errormsg ? errormsg
+                                       : "(error object is not a string)")
+                          << std::endl;
                 return false;
             }
             return true;
         }
 
         void load_file(const char *path) {
-            if (luaL_dofile(m_state.get(), path) != LUA_OK) {
-                throw lua_exception(lua_tostring(m_state.get(), STACK_TOP));
-            }
+            try_load_file(path).throw_if_error();
         }
 
         void load_file(const std::string &path) {
             load_file(path.c_str());
         }
 
+        // Runs a chunk held in memory (text only). With cached set the
+        // compiled form is shared through chunk_cache, so a script body
+        // loaded into many states is only parsed once.
+        void load_buffer(std::string_view source,
+                         const std::string &chunkname = "=buffer",
+                         bool cached = true) {
+            try_load_buffer(source, chunkname, cached).throw_if_error();
+        }
+
+        // Non-throwing variants of load_file and load_buffer; on failure
+        // the error message is left on top of the stack. Files are
+        // compiled straight from a memory mapping (see load_mapped_file).
+        call_result try_load_file(const char *path) {
+            int top = lua_gettop(m_state.get());
+            int status = load_mapped_file(m_state.get(), path);
+            return run_loaded(status, top);
+        }
+
+        call_result try_load_buffer(std::string_view source,
+                                    const std::string &chunkname = "=buffer",
+                                    bool cached = true) {
+            int top = lua_gettop(m_state.get());
+            int status =
+                cached ? chunk_cache::instance().load(m_state.get(), source,
+                                                      chunkname.c_str())
+                       : load_chunk(m_state.get(), source, chunkname.c_str());
+            return run_loaded(status, top);
+        }
+
         void push(void) {
             lua_pushnil(m_state.get());
+            observe_stack(m_state.get());
         }
 
         void push(double val) {
             lua_pushnumber(m_state.get(), val);
+            observe_stack(m_state.get());
         }
 
         void push(int val) {
             lua_pushnumber(m_state.get(), val);
+            observe_stack(m_state.get());
         }
 
         void push(bool val) {
             lua_pushboolean(m_state.get(), val);
+            observe_stack(m_state.get());
         }
 
         void push(const char *val) {
-            lua_pushstring(m_state.get(), val);
+            run_protected(m_state.get(), 0, 1,
+                          [val](lua_State *L) { lua_pushstring(L, val); });
+            observe_stack(m_state.get());
         }
 
         void push(const std::string val) {
-            lua_pushstring(m_state.get(), val.c_str());
+            push(val.c_str());
+        }
+
+        void push(const value &val) {
+            run_protected(m_state.get(), 0, 1,
+                          [&val](lua_State *L) { val.push(L); });
+            observe_stack(m_state.get());
         }
 
         string_reference get_string(stack_index i = STACK_TOP) {
-            lua_tostring(m_state.get(), i.get());
+            // converts in place, like lua_tostring
+            int index = lua_absindex(m_state.get(), i.get());
+            lua_pushvalue(m_state.get(), index);
+            run_protected(m_state.get(), 1, 1,
+                          [](lua_State *L) { lua_tostring(L, 1); });
+            lua_replace(m_state.get(), index);
+            observe_stack(m_state.get());
             return string_reference(m_state, size());
         }
 
+        // Parses a JSON document and pushes it as Lua tables (null becomes
+        // nil). Throws lua_exception on malformed input.
+        void decode_json(std::string_view text) {
+            run_protected(m_state.get(), 0, 1,
+                          [text](lua_State *L) { json_decode(L, text); });
+            observe_stack(m_state.get());
+        }
+
+        // Encodes the value at i as JSON; the view stays valid until the
+        // next encode on this state.
+        std::string_view encode_json(stack_index i = STACK_TOP) {
+            std::string_view out;
+            lua_pushvalue(m_state.get(), i.get());
+            run_protected(m_state.get(), 1, 0,
+                          [&out](lua_State *L) { out = json_encode(L, 1); });
+            return out;
+        }
+
+        // Captures the value at i; unlike the references it stays valid
+        // after the stack changes.
+        value get_value(stack_index i = STACK_TOP) {
+            return value::capture(m_state.get(), i.get());
+        }
+
         number_reference get_number(stack_index i = STACK_TOP) {
             lua_tonumber(m_state.get(), i.get());
+            observe_stack(m_state.get());
             return number_reference(m_state, lua_gettop(m_state.get()));
         }
 
         boolean_reference get_boolean(stack_index i = STACK_TOP) {
             lua_toboolean(m_state.get(), i.get());
+            observe_stack(m_state.get());
             return boolean_reference(m_state, lua_gettop(m_state.get()));
         }
 
         string_reference get_string(const std::string &name) {
-            lua_getglobal(m_state.get(), name.c_str());
+            push_global(name);
             return string_reference(m_state, top());
         }
 
         number_reference get_number(const std::string &name) {
-            lua_getglobal(m_state.get(), name.c_str());
+            push_global(name);
             return number_reference(m_state, top());
         }
 
         boolean_reference get_boolean(const std::string &name) {
-            lua_getglobal(m_state.get(), name.c_str());
+            push_global(name);
             return boolean_reference(m_state, top());
         }
 
         function_reference get_function(const std::string &name,
                                         const int input = 0,
                                         const int output = 0) {
-            lua_getglobal(m_state.get(), name.c_str());
-            return function_reference(m_state, top(), input, output);
+            push_global(name);
+            return function_reference(m_state, top(), input, output,
+                                      name.c_str());
         }
 
         table_reference get_table(const std::string &name) {
-            lua_getglobal(m_state.get(), name.c_str());
+            push_global(name);
             return table_reference(m_state, top());
         }
 
+        // Makes sure at least slots more values can be pushed without the
+        // stack having to grow.
+        void reserve(int slots) {
+            if (!lua_checkstack(m_state.get(), slots)) {
+                throw lua_exception("cannot reserve " + std::to_string(slots) +
+                                    " stack slots");
+            }
+        }
+
+        // Lazy lookup through the globals, e.g. L["Config"]["net"]["size"]
+        path_proxy operator[](const char *name) {
+            return path_proxy(m_state.get(), name);
+        }
+
+        path_proxy operator[](const std::string &name) {
+            return path_proxy(m_state.get(), name.c_str());
+        }
+
+        template <typename T>
+        T get(const path &p, T fallback = T()) {
+            return p.get<T>(m_state.get(), fallback);
+        }
+
         void pop(int number_of_elements = 1) {
             lua_pop(m_state.get(), number_of_elements);
         }
@@ -145,12 +272,83 @@ namespace lualao {
                 pop(s);
         }
 
-        void open_libs() {
-            luaL_openlibs(m_state.get());
+        // Opens the standard libraries in mask (LIB_* values, all of them
+        // by default).
+        void open_libs(unsigned mask = LIB_ALL) {
+            open_libraries(m_state.get(), mask);
+        }
+
+        // Like open_libs, but each library except base and package is only
+        // built when a script first reads its global; see
+        // open_libraries_lazily().
+        void open_libs_lazily(unsigned mask = LIB_ALL) {
+            open_libraries_lazily(m_state.get(), mask);
+        }
+
+        gc_control gc() {
+            return gc_control(m_state.get());
+        }
+
+        // Memory held by the state; all zero for states created outside
+        // lualao with their own allocator.
+        memory_stats memory() {
+            memory_accounting *accounting = memory_accounting::of(m_state.get());
+            return accounting ? accounting->stats() : memory_stats();
+        }
+
+        // Caps the memory the state may hold (0 for no limit). Allocations
+        // past the limit fail as Lua memory errors, surfacing as
+        // lua_memory_error.
+        void set_memory_limit(std::size_t bytes) {
+            memory_accounting *accounting = memory_accounting::of(m_state.get());
+            if (accounting == nullptr)
+                throw lua_exception("state does not use lualao's allocator");
+            accounting->set_limit(bytes);
+        }
+
+        // Configures the default message handler used by function calls
+        // and loads: when enabled, errors carry a traceback of at most
+        // max_levels frames, formatted only when the message is read.
+        void set_traceback(bool enabled, int max_levels = 16) {
+            run_protected(m_state.get(), 0, 0, [&](lua_State *L) {
+                traceback_options &options =
+                    state_extension<traceback_options>(L);
+                options.enabled = enabled;
+                options.max_levels = max_levels;
+            });
         }
 
       private:
         std::shared_ptr<lua_State> m_state;
+
+        void push_global(const std::string &name) {
+            run_protected(m_state.get(), 0, 1, [&name](lua_State *L) {
+                lua_getglobal(L, name.c_str());
+            });
+            observe_stack(m_state.get());
+        }
+
+        call_result run_loaded(int status, int top) {
+            if (status == LUA_OK)
+                status = pcall_with_traceback(m_state.get(), 0, LUA_MULTRET);
+            if (status != LUA_OK)
+                return call_result::failure(m_state.get(), status);
+            return call_result::success(lua_gettop(m_state.get()) - top);
+        }
+
+        static void close(lua_State *L) {
+            memory_accounting *accounting = memory_accounting::of(L);
+            lua_close(L);
+            delete accounting;
+        }
+
+        static int panic(lua_State *L) {
+            const char *message = lua_tostring(L, -1);
+            std::cerr << "PANIC: unprotected error in call to Lua API ("
+                      << (message ? message : "error object is not a string")
+                      << ")" << std::endl;
+            return 0;
+        }
     };
 
     void stack_debug_print(state &stack) {
@@ -0,0 +1,61 @@
+
+#pragma once
+
+#include <new>
+
+extern "C" {
+#include "lua.h"
+}
+
+namespace lualao {
+
+    template <typename T>
+    int destroy_state_extension(lua_State *L) {
+        static_cast<T *>(lua_touserdata(L, 1))->~T();
+        return 0;
+    }
+
+    template <typename T>
+    void *state_extension_key() {
+        static const char key = 0;
+        return const_cast<char *>(&key);
+    }
+
+    // The T attached to L by state_extension(), or nullptr when it has not
+    // been created yet. Never allocates, so it is safe outside a protected
+    // call.
+    template <typename T>
+    T *find_state_extension(lua_State *L) {
+        T *existing = nullptr;
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, state_extension_key<T>()) ==
+            LUA_TUSERDATA)
+            existing = static_cast<T *>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        return existing;
+    }
+
+    // C++ data attached to a lua_State: one default constructed T per
+    // state, created on first use, stored as a userdata in the registry
+    // (keyed by a per-type address) and destroyed when the state closes.
+    // Creating it allocates, so the first call must run inside a protected
+    // call (or before the state has a memory limit).
+    template <typename T>
+    T &state_extension(lua_State *L) {
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, state_extension_key<T>()) ==
+            LUA_TUSERDATA) {
+            T *existing = static_cast<T *>(lua_touserdata(L, -1));
+            lua_pop(L, 1);
+            return *existing;
+        }
+        lua_pop(L, 1);
+
+        T *created = new (lua_newuserdata(L, sizeof(T))) T();
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, destroy_state_extension<T>);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, state_extension_key<T>());
+        return *created;
+    }
+
+};
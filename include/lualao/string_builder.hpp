@@ -0,0 +1,272 @@
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/module.hpp"
+#include "lualao/state_extension.hpp"
+
+namespace lualao {
+
+    // Buffers released by string builders of one state, kept for the next
+    // builder so report loops do not reallocate their output every time.
+    // Only a few buffers of moderate size are kept.
+    class string_buffer_pool {
+      public:
+        static const std::size_t MAX_POOLED = 16;
+        static const std::size_t MAX_POOLED_CAPACITY = 1 << 20;
+        // requested capacities are only reserved up to this much; larger
+        // builders grow as they are appended to
+        static const std::size_t MAX_INITIAL_CAPACITY = 64 << 20;
+
+        // reserved up front so release() never allocates inside __gc
+        string_buffer_pool() {
+            m_free.reserve(MAX_POOLED);
+        }
+
+        std::string acquire(std::size_t capacity = 0) {
+            std::string buffer;
+            if (!m_free.empty()) {
+                buffer = std::move(m_free.back());
+                m_free.pop_back();
+            }
+            buffer.reserve(std::min(capacity, MAX_INITIAL_CAPACITY));
+            return buffer;
+        }
+
+        void release(std::string &&buffer) {
+            if (m_free.size() >= MAX_POOLED ||
+                buffer.capacity() > MAX_POOLED_CAPACITY)
+                return;
+            buffer.clear();
+            m_free.push_back(std::move(buffer));
+        }
+
+        std::size_t pooled() const {
+            return m_free.size();
+        }
+
+      private:
+        std::vector<std::string> m_free;
+    };
+
+    // Growable output buffer behind the string builder userdata. Appends
+    // are amortised O(1), so building a report no longer creates one
+    // intermediate Lua string per piece.
+    class string_builder {
+      public:
+        explicit string_builder(std::string &&buffer)
+            : m_buffer(std::move(buffer)) {}
+
+        void append(std::string_view text) {
+            m_buffer.append(text.data(), text.size());
+        }
+
+        void append_integer(lua_Integer i) {
+            char digits[32];
+            auto result = std::to_chars(digits, digits + sizeof(digits),
+                                        static_cast<long long>(i));
+            m_buffer.append(digits, result.ptr);
+        }
+
+        // Formats like Lua's tostring (%.14g, with ".0" for integral
+        // floats).
+        void append_number(lua_Number n) {
+            char digits[64];
+            int length = std::snprintf(digits, sizeof(digits), "%.14g",
+                                       static_cast<double>(n));
+            m_buffer.append(digits, static_cast<std::size_t>(length));
+            if (std::strpbrk(digits, ".eEni") == nullptr)
+                m_buffer += ".0";
+        }
+
+        // Fixed notation with the given number of decimals.
+        void append_fixed(lua_Number n, int decimals) {
+            char digits[128];
+            auto result = std::to_chars(digits, digits + sizeof(digits),
+                                        static_cast<double>(n),
+                                        std::chars_format::fixed, decimals);
+            if (result.ec != std::errc())
+                throw lua_exception("number too large for fixed format");
+            m_buffer.append(digits, result.ptr);
+        }
+
+        std::string_view view() const {
+            return m_buffer;
+        }
+
+        std::size_t size() const {
+            return m_buffer.size();
+        }
+
+        void clear() {
+            m_buffer.clear();
+        }
+
+        // Hands the bytes over without copying; the builder is empty
+        // afterwards.
+        std::string take() {
+            return std::move(m_buffer);
+        }
+
+      private:
+        std::string m_buffer;
+    };
+
+    inline constexpr const char *STRING_BUILDER_METATABLE =
+        "lualao.string_builder";
+
+    inline string_builder *check_string_builder(lua_State *L, int index) {
+        return static_cast<string_builder *>(
+            luaL_checkudata(L, index, STRING_BUILDER_METATABLE));
+    }
+
+    // b:append(...) with strings and numbers; returns b for chaining.
+    inline int string_builder_append(lua_State *L) {
+        string_builder *b = check_string_builder(L, 1);
+        int top = lua_gettop(L);
+        for (int i = 2; i <= top; ++i) {
+            int type = lua_type(L, i);
+            if (type != LUA_TNUMBER && type != LUA_TSTRING)
+                return luaL_argerror(L, i, "string or number expected");
+        }
+        translate_exceptions(L, [&]() {
+            for (int i = 2; i <= top; ++i) {
+                if (lua_type(L, i) == LUA_TSTRING) {
+                    std::size_t len = 0;
+                    const char *s = lua_tolstring(L, i, &len);
+                    b->append(std::string_view(s, len));
+                } else if (lua_isinteger(L, i)) {
+                    b->append_integer(lua_tointeger(L, i));
+                } else {
+                    b->append_number(lua_tonumber(L, i));
+                }
+            }
+            return 0;
+        });
+        lua_settop(L, 1);
+        return 1;
+    }
+
+    // b:append_fixed(n, decimals)
+    inline int string_builder_append_fixed(lua_State *L) {
+        string_builder *b = check_string_builder(L, 1);
+        lua_Number n = luaL_checknumber(L, 2);
+        lua_Integer decimals = luaL_optinteger(L, 3, 2);
+        luaL_argcheck(L, decimals >= 0 && decimals <= 32, 3,
+                      "decimals out of range");
+        translate_exceptions(L, [&]() {
+            b->append_fixed(n, static_cast<int>(decimals));
+            return 0;
+        });
+        lua_settop(L, 1);
+        return 1;
+    }
+
+    inline int string_builder_tostring(lua_State *L) {
+        std::string_view text = check_string_builder(L, 1)->view();
+        lua_pushlstring(L, text.data(), text.size());
+        return 1;
+    }
+
+    inline int string_builder_len(lua_State *L) {
+        lua_pushinteger(
+            L, static_cast<lua_Integer>(check_string_builder(L, 1)->size()));
+        return 1;
+    }
+
+    inline int string_builder_clear(lua_State *L) {
+        check_string_builder(L, 1)->clear();
+        lua_settop(L, 1);
+        return 1;
+    }
+
+    inline int string_builder_gc(lua_State *L) {
+        string_builder *b = static_cast<string_builder *>(lua_touserdata(L, 1));
+        string_buffer_pool *pool = find_state_extension<string_buffer_pool>(L);
+        if (pool != nullptr)
+            pool->release(b->take());
+        b->~string_builder();
+        return 0;
+    }
+
+    namespace detail {
+        // The builder starts out empty and gets its metatable (with __gc)
+        // before anything that can fail runs, so a failure later on cannot
+        // leak its buffer. C++ exceptions (an oversized capacity, say)
+        // become Lua errors.
+        inline string_builder *new_string_builder(lua_State *L,
+                                                  std::size_t capacity) {
+            void *memory = lua_newuserdata(L, sizeof(string_builder));
+            string_builder *b = new (memory) string_builder(std::string());
+            if (luaL_newmetatable(L, STRING_BUILDER_METATABLE)) {
+                static const luaL_Reg methods[] = {
+                    {"append", string_builder_append},
+                    {"append_fixed", string_builder_append_fixed},
+                    {"tostring", string_builder_tostring},
+                    {"clear", string_builder_clear},
+                    {"len", string_builder_len},
+                    {nullptr, nullptr}};
+                luaL_newlib(L, methods);
+                lua_setfield(L, -2, "__index");
+                lua_pushcfunction(L, string_builder_tostring);
+                lua_setfield(L, -2, "__tostring");
+                lua_pushcfunction(L, string_builder_len);
+                lua_setfield(L, -2, "__len");
+                lua_pushcfunction(L, string_builder_gc);
+                lua_setfield(L, -2, "__gc");
+            }
+            lua_setmetatable(L, -2);
+
+            translate_exceptions(L, [&]() {
+                string_buffer_pool &pool =
+                    state_extension<string_buffer_pool>(L);
+                *b = string_builder(pool.acquire(capacity));
+                return 0;
+            });
+            return b;
+        }
+    };
+
+    // Pushes a new builder whose buffer comes from the state's pool.
+    inline string_builder *push_string_builder(lua_State *L,
+                                               std::size_t capacity = 0) {
+        string_builder *b = nullptr;
+        run_protected(L, 0, 1, [&](lua_State *P) {
+            b = detail::new_string_builder(P, capacity);
+        });
+        return b;
+    }
+
+    // strbuf.new([capacity])
+    inline int string_builder_new(lua_State *L) {
+        lua_Integer capacity = luaL_optinteger(L, 1, 0);
+        luaL_argcheck(L, capacity >= 0, 1, "negative capacity");
+        detail::new_string_builder(L, static_cast<std::size_t>(capacity));
+        return 1;
+    }
+
+    inline constexpr luaL_Reg string_builder_functions[] = {
+        {"new", string_builder_new},
+        {nullptr, nullptr}};
+
+    // require("strbuf") once registered with preload_module().
+    inline constexpr module string_builder_module =
+        make_module("strbuf", string_builder_functions);
+
+};
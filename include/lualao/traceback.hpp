@@ -0,0 +1,192 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/state_extension.hpp"
+
+namespace lualao {
+
+    // Per-state settings of the default message handler (see
+    // state::set_traceback()).
+    struct traceback_options {
+        bool enabled = true;
+        int max_levels = 16;
+    };
+
+    struct error_trace_frame {
+        char source[LUA_IDSIZE];
+        char name[48];
+        char what;
+        int line;
+        int defined;
+    };
+
+    // What the default handler leaves as error object: the frames of the
+    // failing call, captured while they still exist, plus the original
+    // message as user value. Turning it into "message\nstack traceback:..."
+    // is deferred until someone asks for the text (error_message() or
+    // tostring), so errors that are only counted or retried never pay for
+    // formatting.
+    struct error_trace {
+        int levels;
+        bool truncated;
+
+        static constexpr const char *METATABLE = "lualao.error_trace";
+
+        error_trace_frame *frames() {
+            return reinterpret_cast<error_trace_frame *>(this + 1);
+        }
+
+        std::string format(const char *message) {
+            std::string text(message);
+            text += "\nstack traceback:";
+            error_trace_frame *frame = frames();
+            for (int i = 0; i < levels; ++i, ++frame) {
+                char line[32];
+                text += "\n\t";
+                text += frame->source;
+                text += ':';
+                if (frame->line > 0) {
+                    std::snprintf(line, sizeof(line), "%d:", frame->line);
+                    text += line;
+                }
+                text += " in ";
+                if (frame->name[0] != '\0') {
+                    text += "function '";
+                    text += frame->name;
+                    text += '\'';
+                } else if (frame->what == 'm') {
+                    text += "main chunk";
+                } else if (frame->what == 'C') {
+                    text += '?';
+                } else {
+                    std::snprintf(line, sizeof(line), ":%d>", frame->defined);
+                    text += "function <";
+                    text += frame->source;
+                    text += line;
+                }
+            }
+            if (truncated)
+                text += "\n\t...";
+            return text;
+        }
+    };
+
+    inline int error_trace_tostring(lua_State *L) {
+        error_trace *trace = static_cast<error_trace *>(
+            luaL_checkudata(L, 1, error_trace::METATABLE));
+        lua_getuservalue(L, 1);
+        std::string text = trace->format(lua_tostring(L, -1));
+        lua_pushlstring(L, text.data(), text.size());
+        return 1;
+    }
+
+    // Default message handler: records up to max_levels frames into an
+    // error_trace. Error objects other than strings and numbers are passed
+    // through untouched so scripts can still raise tables.
+    inline int traceback_handler(lua_State *L) {
+        int type = lua_type(L, 1);
+        if (type != LUA_TSTRING && type != LUA_TNUMBER)
+            return 1;
+
+        traceback_options defaults;
+        traceback_options *options =
+            find_state_extension<traceback_options>(L);
+        int max_levels = (options ? options : &defaults)->max_levels;
+        lua_Debug ar;
+        int levels = 0;
+        // level 0 is this handler
+        while (levels < max_levels && lua_getstack(L, levels + 1, &ar))
+            ++levels;
+        bool truncated = lua_getstack(L, levels + 1, &ar) != 0;
+
+        error_trace *trace = static_cast<error_trace *>(lua_newuserdata(
+            L, sizeof(error_trace) + levels * sizeof(error_trace_frame)));
+        trace->levels = levels;
+        trace->truncated = truncated;
+        error_trace_frame *frame = trace->frames();
+        for (int level = 1; level <= levels; ++level, ++frame) {
+            lua_getstack(L, level, &ar);
+            lua_getinfo(L, "Sln", &ar);
+            std::memcpy(frame->source, ar.short_src, sizeof(frame->source));
+            std::snprintf(frame->name, sizeof(frame->name), "%s",
+                          ar.name ? ar.name : "");
+            frame->what = ar.what[0];
+            frame->line = ar.currentline;
+            frame->defined = ar.linedefined;
+        }
+
+        if (luaL_newmetatable(L, error_trace::METATABLE)) {
+            lua_pushcfunction(L, error_trace_tostring);
+            lua_setfield(L, -2, "__tostring");
+        }
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, 1);
+        lua_tostring(L, -1);
+        lua_setuservalue(L, -2);
+        return 1;
+    }
+
+    // Body of error_message(), which runs it under lua_pcall because
+    // formatting allocates.
+    inline int error_message_text(lua_State *L) {
+        if (luaL_testudata(L, 1, error_trace::METATABLE) != nullptr)
+            return error_trace_tostring(L);
+        lua_tostring(L, 1);
+        return 1;
+    }
+
+    // Text of the error object at idx. A captured error_trace is formatted
+    // here and replaced in place by the resulting string, so the pointer
+    // stays valid as long as the value stays on the stack. Returns nullptr
+    // for error objects without a textual form. Formatting runs protected:
+    // when it fails (out of memory, say) the error object is replaced by
+    // the message of that failure instead.
+    inline const char *error_message(lua_State *L, int idx,
+                                     std::size_t *len = nullptr) {
+        idx = lua_absindex(L, idx);
+        int type = lua_type(L, idx);
+        if ((type == LUA_TUSERDATA || type == LUA_TNUMBER) &&
+            lua_checkstack(L, 2)) {
+            lua_pushcfunction(L, error_message_text);
+            lua_pushvalue(L, idx);
+            lua_pcall(L, 1, 1, 0);
+            lua_replace(L, idx);
+        }
+        if (lua_type(L, idx) != LUA_TSTRING) {
+            if (len != nullptr)
+                *len = 0;
+            return nullptr;
+        }
+        return lua_tolstring(L, idx, len);
+    }
+
+    // lua_pcall with the state's default message handler slotted in below
+    // the function (unless disabled with state::set_traceback()). The
+    // handler is a light C function, so nothing is allocated per call; it
+    // is removed again before returning, leaving the stack exactly as
+    // lua_pcall would.
+    inline int pcall_with_traceback(lua_State *L, int nargs, int nresults) {
+        traceback_options *options =
+            find_state_extension<traceback_options>(L);
+        if (options != nullptr && !options->enabled)
+            return lua_pcall(L, nargs, nresults, 0);
+
+        int function = lua_gettop(L) - nargs;
+        lua_pushcfunction(L, traceback_handler);
+        lua_insert(L, function);
+        int status = lua_pcall(L, nargs, nresults, function);
+        lua_remove(L, function);
+        return status;
+    }
+
+};
@@ -47,8 +47,9 @@ namespace lualao {
             LIGHTUSERDATA_TYPE = LUA_TLIGHTUSERDATA
         };
 
-        type(const int val) {
-            int value;
+        constexpr type(const int val)
+            : m_value(NONE_TYPE) {
+            int value = NONE_TYPE;
             switch (val) {
                 case LUA_TNONE:
                     value = NONE_TYPE;
@@ -85,26 +86,25 @@ namespace lualao {
                     break;
             }
             m_value = value;
-        };
-        virtual ~type() = default;
+        }
 
-        operator int() const {
+        constexpr operator int() const {
             return m_value;
         }
 
-        bool operator==(const type &other) const {
+        constexpr bool operator==(const type &other) const {
             return m_value == other.m_value;
         }
 
-        bool operator!=(const type &other) const {
+        constexpr bool operator!=(const type &other) const {
             return m_value != other.m_value;
         }
 
-        bool operator==(const int &other) const {
+        constexpr bool operator==(const int &other) const {
             return m_value == other;
         }
 
-        bool operator!=(const int &other) const {
+        constexpr bool operator!=(const int &other) const {
             return m_value != other;
         }
 
@@ -1,7 +1,7 @@
-
 #pragma once
 
 #include <memory>
+#include <type_traits>
 #include "lua.h"
 #include "stack_reference_base.hpp"
 #include "lualao/stack_index.hpp"
@@ -9,22 +9,26 @@
 
 namespace lualao {
 
-    class boolean_reference: public stack_reference_base {
+    template <>
+    class stack_reference<type::BOOLEAN_TYPE>
+        : public stack_reference_base<type::BOOLEAN_TYPE> {
       public:
-        boolean_reference(std::shared_ptr<lua_State> s, stack_index i)
-            : stack_reference_base(s, i, type::BOOLEAN_TYPE) {}
-        virtual ~boolean_reference() = default;
+        using stack_reference_base::stack_reference_base;
 
-        bool getValue() {
+        bool getValue() const {
             if (isValid()) {
-                return lua_toboolean(m_parent.get(), m_index.get());
+                return lua_toboolean(m_parent, m_index.get());
             }
             return false;
         }
 
-        bool operator*() {
+        bool operator*() const {
             return getValue();
         }
     };
 
+    using boolean_reference = stack_reference<type::BOOLEAN_TYPE>;
+
+    static_assert(std::is_trivially_copyable_v<boolean_reference>);
+
 }; // namespace lualao
@@ -3,44 +3,98 @@
 
 #include "lua.h"
 #include <memory>
+#include <type_traits>
 #include "stack_reference_base.hpp"
 #include "lualao/stack_index.hpp"
 #include "lualao/type.hpp"
 #include "lualao/lua_exception.hpp"
+#include "lualao/call_result.hpp"
+
+#ifdef LUALAO_CALL_METRICS
+    #include "lualao/metrics/call_metrics.hpp"
+#endif
 
 namespace lualao {
 
-    class function_reference: public stack_reference_base {
+    template <>
+    class stack_reference<type::FUNCTION_TYPE>
+        : public stack_reference_base<type::FUNCTION_TYPE> {
       private:
         int m_input;
         int m_output;
+#ifdef LUALAO_CALL_METRICS
+        call_stats *m_stats = nullptr;
+#endif
 
       public:
-        function_reference(std::shared_ptr<lua_State> s, stack_index i,
-                           const int input, const int output)
-            : stack_reference_base(s, i, type::FUNCTION_TYPE)
+        constexpr stack_reference(lua_State *s, stack_index i,
+                                  const int input, const int output)
+            : stack_reference_base(s, i)
             , m_input(input)
             , m_output(output) {}
-        virtual ~function_reference() = default;
 
+        // name is only used to file call metrics (LUALAO_CALL_METRICS)
+        stack_reference(lua_State *s, stack_index i, const int input,
+                        const int output, const char *name)
+            : stack_reference(s, i, input, output) {
+#ifdef LUALAO_CALL_METRICS
+            m_stats = name ? call_metrics::instance().find_or_add(name)
+                           : nullptr;
+#else
+            (void)name;
+#endif
+        }
+
+        stack_reference(const std::shared_ptr<lua_State> &s, stack_index i,
+                        const int input, const int output,
+                        const char *name = nullptr)
+            : stack_reference(s.get(), i, input, output, name) {}
+
+        // handlerIndex 0 uses the state's default message handler, which
+        // adds a traceback to the error (see state::set_traceback()).
         void safeCall(int handlerIndex = 0) {
             if (isValid()) {
-                int top = lua_gettop(m_parent.get());
-
-                if ((top - m_index) < m_input) {
-                    throw lua_exception(
-                        "Not enough arguments parsed to function");
-                }
-
-                if (lua_pcall(m_parent.get(), m_input, m_output,
-                              handlerIndex) != LUA_OK) {
-                    throw lua_exception(
-                        lua_tostring(m_parent.get(), STACK_TOP.get()));
-                }
+                try_call(handlerIndex).throw_if_error();
             }
         }
 
-        function_reference &operator*() {
+        // Like safeCall, but reports errors through the result instead of
+        // throwing. An invalid reference is reported as an error too.
+        call_result try_call(int handlerIndex = 0) {
+            lua_State *L = m_parent;
+            if (!isValid()) {
+                lua_pushliteral(L, "attempt to call an invalid function "
+                                   "reference");
+                return call_result::failure(L, LUA_ERRRUN);
+            }
+#ifdef LUALAO_CALL_METRICS
+            call_timer timer(m_stats);
+#endif
+            int top = lua_gettop(L);
+
+            if ((top - m_index) < m_input) {
+#ifdef LUALAO_CALL_METRICS
+                timer.failed();
+#endif
+                lua_pushliteral(L, "Not enough arguments parsed to function");
+                return call_result::failure(L, LUA_ERRRUN);
+            }
+
+            int base = top - m_input - 1;
+            int status =
+                handlerIndex == 0
+                    ? pcall_with_traceback(L, m_input, m_output)
+                    : lua_pcall(L, m_input, m_output, handlerIndex);
+            if (status != LUA_OK) {
+#ifdef LUALAO_CALL_METRICS
+                timer.failed();
+#endif
+                return call_result::failure(L, status);
+            }
+            return call_result::success(lua_gettop(L) - base);
+        }
+
+        stack_reference &operator*() {
             return *this;
         }
 
@@ -49,4 +103,8 @@ namespace lualao {
         }
     };
 
+    using function_reference = stack_reference<type::FUNCTION_TYPE>;
+
+    static_assert(std::is_trivially_copyable_v<function_reference>);
+
 }; // namespace lualao
@@ -1,27 +1,31 @@
-
 #pragma once
 
+#include <type_traits>
 #include "stack_reference_base.hpp"
 #include "lualao/type.hpp"
 
 namespace lualao {
 
-    class number_reference: public stack_reference_base {
+    template <>
+    class stack_reference<type::NUMBER_TYPE>
+        : public stack_reference_base<type::NUMBER_TYPE> {
       public:
-        number_reference(std::shared_ptr<lua_State> s, stack_index i)
-            : stack_reference_base(s, i, type::NUMBER_TYPE) {}
-        virtual ~number_reference() = default;
+        using stack_reference_base::stack_reference_base;
 
-        double getValue() {
+        double getValue() const {
             if (isValid()) {
-                return lua_tonumber(m_parent.get(), m_index.get());
+                return lua_tonumber(m_parent, m_index.get());
             }
             return 0;
         }
 
-        double operator*() {
+        double operator*() const {
             return getValue();
         }
     };
 
+    using number_reference = stack_reference<type::NUMBER_TYPE>;
+
+    static_assert(std::is_trivially_copyable_v<number_reference>);
+
 }; // namespace lualao
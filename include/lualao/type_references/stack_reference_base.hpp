@@ -7,37 +7,60 @@
 
 namespace lualao {
 
+    // Common part of the stack references: a state pointer and an index,
+    // with the expected Lua type as a compile time tag. References are
+    // trivially copyable values; they do not own the state and, like the
+    // stack slot they name, must not outlive it.
+    template <int TYPE>
     class stack_reference_base {
-      private:
-        int m_type;
-
       protected:
-        std::shared_ptr<lua_State> m_parent;
+        lua_State *m_parent;
         stack_index m_index;
 
       public:
-        stack_reference_base(std::shared_ptr<lua_State> s, stack_index i,
-                             int type)
-            : m_type(type)
-            , m_parent(s)
-            , m_index(i.get()) {}
+        static constexpr int type_tag = TYPE;
+
+        constexpr stack_reference_base(lua_State *s, stack_index i)
+            : m_parent(s)
+            , m_index(i) {}
 
-        virtual ~stack_reference_base() = default;
+        // for callers holding the state's shared pointer; ownership is not
+        // shared
+        stack_reference_base(const std::shared_ptr<lua_State> &s,
+                             stack_index i)
+            : m_parent(s.get())
+            , m_index(i) {}
 
-        bool isValid() {
-            lua_State *state = m_parent.get();
-            int current_top = lua_gettop(state);
+        bool isValid() const {
+            int current_top = lua_gettop(m_parent);
             bool is_not_empty_stack = current_top != 0;
             bool is_index_within_bounds =
                 m_index.is_from_bottom() && m_index <= current_top;
-            bool do_type_match = lua_type(state, m_index) == m_type;
+            bool do_type_match = lua_type(m_parent, m_index) == TYPE;
             return is_not_empty_stack && is_index_within_bounds &&
                    do_type_match;
         }
 
-        operator bool() {
+        operator bool() const {
             return isValid();
         }
+
+        constexpr lua_State *lua_state() const {
+            return m_parent;
+        }
+
+        constexpr int index() const {
+            return m_index.get();
+        }
+    };
+
+    // A reference to a stack slot holding a value of Lua type TYPE. The
+    // types with extra accessors specialise it (boolean_reference and the
+    // other aliases).
+    template <int TYPE>
+    class stack_reference: public stack_reference_base<TYPE> {
+      public:
+        using stack_reference_base<TYPE>::stack_reference_base;
     };
 
 }; // namespace lualao
@@ -1,29 +1,34 @@
-
 #pragma once
 
 #include <memory>
+#include <string>
+#include <type_traits>
 #include "stack_reference_base.hpp"
 #include "lua.h"
 #include "lualao/type.hpp"
 
 namespace lualao {
 
-    class string_reference: public stack_reference_base {
+    template <>
+    class stack_reference<type::STRING_TYPE>
+        : public stack_reference_base<type::STRING_TYPE> {
       public:
-        string_reference(std::shared_ptr<lua_State> s, stack_index i)
-            : stack_reference_base(s, i, type::STRING_TYPE) {}
-        virtual ~string_reference() = default;
+        using stack_reference_base::stack_reference_base;
 
-        std::string getValue() {
+        std::string getValue() const {
             if (isValid()) {
-                return lua_tostring(m_parent.get(), m_index.get());
+                return lua_tostring(m_parent, m_index.get());
             }
             return "";
         }
 
-        std::string operator*() {
+        std::string operator*() const {
             return getValue();
         }
     };
 
+    using string_reference = stack_reference<type::STRING_TYPE>;
+
+    static_assert(std::is_trivially_copyable_v<string_reference>);
+
 }; // namespace lualao
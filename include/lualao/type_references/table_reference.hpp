@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <string>
+#include <type_traits>
 #include "lua.h"
 #include "lualao/stack_index.hpp"
 #include "lualao/type.hpp"
@@ -11,64 +12,73 @@
 #include "boolean_reference.hpp"
 #include "number_reference.hpp"
 #include "function_reference.hpp"
+#include "lualao/stack_tracker.hpp"
 
 namespace lualao {
 
-    struct table_reference: public stack_reference_base {
-        table_reference(std::shared_ptr<lua_State> s, stack_index i)
-            : stack_reference_base(s, i, type::TABLE_TYPE) {}
-        virtual ~table_reference() = default;
+    template <>
+    struct stack_reference<type::TABLE_TYPE>
+        : public stack_reference_base<type::TABLE_TYPE> {
+        using stack_reference_base::stack_reference_base;
 
         string_reference get_string(const std::string &name) {
-            lua_pushstring(m_parent.get(), name.c_str());
-            lua_gettable(m_parent.get(), m_index.get());
-            return string_reference(m_parent, lua_gettop(m_parent.get()));
+            lua_pushstring(m_parent, name.c_str());
+            lua_gettable(m_parent, m_index.get());
+            observe_stack(m_parent);
+            return string_reference(m_parent, lua_gettop(m_parent));
         }
 
         boolean_reference get_boolean(const std::string &name) {
-            lua_pushstring(m_parent.get(), name.c_str());
-            lua_gettable(m_parent.get(), m_index.get());
-            return boolean_reference(m_parent, lua_gettop(m_parent.get()));
+            lua_pushstring(m_parent, name.c_str());
+            lua_gettable(m_parent, m_index.get());
+            observe_stack(m_parent);
+            return boolean_reference(m_parent, lua_gettop(m_parent));
         }
 
         number_reference get_number(const std::string &name) {
-            lua_pushstring(m_parent.get(), name.c_str());
-            lua_gettable(m_parent.get(), m_index.get());
-            return number_reference(m_parent, lua_gettop(m_parent.get()));
+            lua_pushstring(m_parent, name.c_str());
+            lua_gettable(m_parent, m_index.get());
+            observe_stack(m_parent);
+            return number_reference(m_parent, lua_gettop(m_parent));
         }
 
         function_reference get_function(const std::string &name,
                                         const int input = 0,
                                         const int output = 0) {
-            lua_pushstring(m_parent.get(), name.c_str());
-            lua_gettable(m_parent.get(), m_index.get());
-            return function_reference(m_parent, lua_gettop(m_parent.get()),
-                                      input, output);
+            lua_pushstring(m_parent, name.c_str());
+            lua_gettable(m_parent, m_index.get());
+            observe_stack(m_parent);
+            return function_reference(m_parent, lua_gettop(m_parent),
+                                      input, output, name.c_str());
         }
 
         void set(std::string const &name, std::string value) {
-            lua_pushstring(m_parent.get(), name.c_str());
-            lua_pushstring(m_parent.get(), value.c_str());
-            lua_settable(m_parent.get(), m_index);
+            lua_pushstring(m_parent, name.c_str());
+            lua_pushstring(m_parent, value.c_str());
+            lua_settable(m_parent, m_index);
         }
 
         void set(std::string const &name, double value) {
-            lua_pushstring(m_parent.get(), name.c_str());
-            lua_pushnumber(m_parent.get(), value);
-            lua_settable(m_parent.get(), m_index);
+            lua_pushstring(m_parent, name.c_str());
+            lua_pushnumber(m_parent, value);
+            lua_settable(m_parent, m_index);
         }
 
         void set(std::string const &name, bool value) {
-            lua_pushstring(m_parent.get(), name.c_str());
-            lua_pushboolean(m_parent.get(), value);
-            lua_settable(m_parent.get(), m_index);
+            lua_pushstring(m_parent, name.c_str());
+            lua_pushboolean(m_parent, value);
+            lua_settable(m_parent, m_index);
         }
 
         void set(std::string const &name, lua_CFunction f) {
-            lua_pushstring(m_parent.get(), name.c_str());
-            lua_pushcfunction(m_parent.get(), f);
-            lua_settable(m_parent.get(), m_index);
+            lua_pushstring(m_parent, name.c_str());
+            lua_pushcfunction(m_parent, f);
+            lua_settable(m_parent, m_index);
         }
     };
 
+    using table_reference = stack_reference<type::TABLE_TYPE>;
+
+    static_assert(std::is_trivially_copyable_v<table_reference>);
+
 }; // namespace lualao
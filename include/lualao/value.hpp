@@ -0,0 +1,309 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <utility>
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+#include "lualao/lua_exception.hpp"
+
+namespace lualao {
+
+    // A Lua value captured off the stack, so it can outlive the stack slot
+    // and be kept in C++ containers. nil, booleans, numbers and strings of
+    // up to INLINE_CAPACITY bytes are stored inline; longer strings get one
+    // heap block; tables, functions and the other reference types hold a
+    // registry reference.
+    //
+    // Moving never allocates (a moved-from value is nil), so vectors of
+    // thousands of values are cheap to grow. Values holding a registry
+    // reference must be destroyed before their state is closed.
+    class value {
+      public:
+        enum kind_type : std::uint8_t {
+            NIL,
+            BOOLEAN,
+            INTEGER,
+            NUMBER,
+            STRING,
+            REFERENCE
+        };
+
+        static const std::size_t INLINE_CAPACITY = 24;
+
+        value()
+            : m_integer(0)
+            , m_inline_size(0)
+            , m_kind(NIL) {}
+
+        explicit value(bool b)
+            : value() {
+            m_kind = BOOLEAN;
+            m_boolean = b;
+        }
+
+        explicit value(lua_Integer i)
+            : value() {
+            m_kind = INTEGER;
+            m_integer = i;
+        }
+
+        explicit value(int i)
+            : value(static_cast<lua_Integer>(i)) {}
+
+        explicit value(lua_Number n)
+            : value() {
+            m_kind = NUMBER;
+            m_number = n;
+        }
+
+        explicit value(std::string_view text)
+            : value() {
+            assign_string(text);
+        }
+
+        // A null pointer gives nil.
+        explicit value(const char *text)
+            : value() {
+            if (text != nullptr)
+                assign_string(text);
+        }
+
+        // Captures the value at index of L's stack; the stack is left as
+        // it was. Tables, functions and the other reference types get a
+        // registry reference, which allocates in the state, so this must
+        // run where a Lua error is caught (in a lua_CFunction or under
+        // run_protected); host code uses capture().
+        value(lua_State *L, int index)
+            : value() {
+            switch (lua_type(L, index)) {
+                case LUA_TNONE:
+                case LUA_TNIL:
+                    break;
+                case LUA_TBOOLEAN:
+                    m_kind = BOOLEAN;
+                    m_boolean = lua_toboolean(L, index) != 0;
+                    break;
+                case LUA_TNUMBER:
+                    if (lua_isinteger(L, index)) {
+                        m_kind = INTEGER;
+                        m_integer = lua_tointeger(L, index);
+                    } else {
+                        m_kind = NUMBER;
+                        m_number = lua_tonumber(L, index);
+                    }
+                    break;
+                case LUA_TSTRING: {
+                    std::size_t len = 0;
+                    const char *s = lua_tolstring(L, index, &len);
+                    assign_string(std::string_view(s, len));
+                    break;
+                }
+                default:
+                    lua_pushvalue(L, index);
+                    m_reference.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+                    m_reference.state = main_thread(L);
+                    m_kind = REFERENCE;
+                    break;
+            }
+        }
+
+        // Like value(L, index), but under a protected call: a state out of
+        // memory throws lua_memory_error instead of reaching the panic
+        // handler.
+        static value capture(lua_State *L, int index) {
+            value result;
+            if (!lua_checkstack(L, 3))
+                throw lua_exception("stack overflow while capturing value");
+            lua_pushvalue(L, index);
+            run_protected(L, 1, 0,
+                          [&result](lua_State *P) { result = value(P, 1); });
+            return result;
+        }
+
+        value(const value &other)
+            : value() {
+            copy_from(other);
+        }
+
+        value(value &&other) noexcept
+            : value() {
+            steal(other);
+        }
+
+        value &operator=(const value &other) {
+            if (this != &other) {
+                release();
+                copy_from(other);
+            }
+            return *this;
+        }
+
+        value &operator=(value &&other) noexcept {
+            if (this != &other) {
+                release();
+                steal(other);
+            }
+            return *this;
+        }
+
+        ~value() {
+            release();
+        }
+
+        kind_type kind() const {
+            return m_kind;
+        }
+
+        bool is_nil() const {
+            return m_kind == NIL;
+        }
+
+        // Like Lua truthiness: only nil and false are false.
+        bool as_boolean() const {
+            return m_kind == BOOLEAN ? m_boolean : m_kind != NIL;
+        }
+
+        // Numbers convert; anything else is 0.
+        lua_Integer as_integer() const {
+            if (m_kind == INTEGER)
+                return m_integer;
+            if (m_kind == NUMBER)
+                return static_cast<lua_Integer>(m_number);
+            return 0;
+        }
+
+        lua_Number as_number() const {
+            if (m_kind == NUMBER)
+                return m_number;
+            if (m_kind == INTEGER)
+                return static_cast<lua_Number>(m_integer);
+            return 0;
+        }
+
+        // Empty unless the value is a string.
+        std::string_view as_string() const {
+            if (m_kind != STRING)
+                return std::string_view();
+            if (is_inline())
+                return std::string_view(m_inline, m_inline_size);
+            return std::string_view(m_heap.data, m_heap.size);
+        }
+
+        // Pushes the value onto L, which must belong to the same state as
+        // the captured reference, if any.
+        void push(lua_State *L) const {
+            switch (m_kind) {
+                case NIL:
+                    lua_pushnil(L);
+                    break;
+                case BOOLEAN:
+                    lua_pushboolean(L, m_boolean);
+                    break;
+                case INTEGER:
+                    lua_pushinteger(L, m_integer);
+                    break;
+                case NUMBER:
+                    lua_pushnumber(L, m_number);
+                    break;
+                case STRING: {
+                    std::string_view text = as_string();
+                    lua_pushlstring(L, text.data(), text.size());
+                    break;
+                }
+                case REFERENCE:
+                    lua_rawgeti(L, LUA_REGISTRYINDEX, m_reference.ref);
+                    break;
+            }
+        }
+
+      private:
+        // marks strings kept on the heap
+        static const std::uint8_t HEAP_STRING = 0xff;
+
+        union {
+            bool m_boolean;
+            lua_Integer m_integer;
+            lua_Number m_number;
+            char m_inline[INLINE_CAPACITY];
+            struct {
+                char *data;
+                std::size_t size;
+            } m_heap;
+            struct {
+                lua_State *state;
+                int ref;
+            } m_reference;
+        };
+        std::uint8_t m_inline_size;
+        kind_type m_kind;
+
+        bool is_inline() const {
+            return m_inline_size != HEAP_STRING;
+        }
+
+        static lua_State *main_thread(lua_State *L) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+            lua_State *main = lua_tothread(L, -1);
+            lua_pop(L, 1);
+            return main;
+        }
+
+        void assign_string(std::string_view text) {
+            if (text.size() <= INLINE_CAPACITY) {
+                std::memcpy(m_inline, text.data(), text.size());
+                m_inline_size = static_cast<std::uint8_t>(text.size());
+            } else {
+                m_heap.data = new char[text.size()];
+                std::memcpy(m_heap.data, text.data(), text.size());
+                m_heap.size = text.size();
+                m_inline_size = HEAP_STRING;
+            }
+            m_kind = STRING;
+        }
+
+        void copy_from(const value &other) {
+            if (other.m_kind == STRING) {
+                assign_string(other.as_string());
+            } else if (other.m_kind == REFERENCE) {
+                lua_State *L = other.m_reference.state;
+                int ref = LUA_NOREF;
+                run_protected(L, 0, 0, [&other, &ref](lua_State *P) {
+                    other.push(P);
+                    ref = luaL_ref(P, LUA_REGISTRYINDEX);
+                });
+                m_reference.ref = ref;
+                m_reference.state = L;
+                m_kind = REFERENCE;
+            } else {
+                std::memcpy(static_cast<void *>(this), &other, sizeof(value));
+            }
+        }
+
+        void steal(value &other) {
+            std::memcpy(static_cast<void *>(this), &other, sizeof(value));
+            other.m_kind = NIL;
+            other.m_inline_size = 0;
+        }
+
+        void release() {
+            if (m_kind == STRING && !is_inline())
+                delete[] m_heap.data;
+            else if (m_kind == REFERENCE)
+                luaL_unref(m_reference.state, LUA_REGISTRYINDEX,
+                           m_reference.ref);
+            m_kind = NIL;
+            m_inline_size = 0;
+        }
+    };
+
+    static_assert(sizeof(value) <= 32, "lualao::value should stay compact");
+
+};
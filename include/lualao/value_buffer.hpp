@@ -0,0 +1,256 @@
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "lualao/lua_exception.hpp"
+#include "lualao/type.hpp"
+
+namespace lualao {
+
+    // A Lua value (nil, boolean, number, string or a tree of tables of those)
+    // packed into one flat byte buffer. The buffer owns no references into
+    // the state it was packed from, so it can be handed to another thread
+    // and rebuilt on a different state.
+    //
+    // Encoding: a tag byte followed by the payload. Strings are prefixed
+    // with a varint length. Tables store their array and hash counts before
+    // the key/value pairs so the receiver can presize with lua_createtable.
+    class value_buffer {
+      public:
+        enum tag : unsigned char {
+            NIL_TAG,
+            FALSE_TAG,
+            TRUE_TAG,
+            INTEGER_TAG,
+            NUMBER_TAG,
+            STRING_TAG,
+            TABLE_TAG
+        };
+
+        // Nesting limit; also what stops a cyclic table from recursing
+        // forever.
+        static const int MAX_DEPTH = 64;
+
+        value_buffer() = default;
+
+        value_buffer(lua_State *L, int index) {
+            pack(L, index);
+        }
+
+        // Replaces the contents with the value at index. Throws
+        // lua_exception for values that cannot leave their state.
+        void pack(lua_State *L, int index) {
+            int top = lua_gettop(L);
+            m_bytes.clear();
+            try {
+                pack_value(L, lua_absindex(L, index), 0);
+            } catch (...) {
+                lua_settop(L, top);
+                m_bytes.clear();
+                throw;
+            }
+        }
+
+        // Pushes the packed value onto L. Runs protected: when L runs out of
+        // memory halfway this throws lua_memory_error, and on any failure
+        // the stack is left as it was.
+        void unpack(lua_State *L) const {
+            run_protected(L, 0, 1, [this](lua_State *P) {
+                const char *cursor = m_bytes.data();
+                unpack_value(P, cursor, cursor + m_bytes.size(), 0);
+            });
+        }
+
+        const char *data() const {
+            return m_bytes.data();
+        }
+
+        std::size_t size() const {
+            return m_bytes.size();
+        }
+
+        bool empty() const {
+            return m_bytes.empty();
+        }
+
+        void clear() {
+            m_bytes.clear();
+        }
+
+      private:
+        std::string m_bytes;
+
+        void put_tag(tag t) {
+            m_bytes.push_back(static_cast<char>(t));
+        }
+
+        template <typename T>
+        void put_raw(const T &v) {
+            m_bytes.append(reinterpret_cast<const char *>(&v), sizeof(T));
+        }
+
+        void put_varint(std::uint64_t v) {
+            while (v >= 0x80) {
+                m_bytes.push_back(static_cast<char>((v & 0x7f) | 0x80));
+                v >>= 7;
+            }
+            m_bytes.push_back(static_cast<char>(v));
+        }
+
+        void pack_value(lua_State *L, int index, int depth) {
+            switch (lua_type(L, index)) {
+                case LUA_TNIL:
+                    put_tag(NIL_TAG);
+                    break;
+                case LUA_TBOOLEAN:
+                    put_tag(lua_toboolean(L, index) ? TRUE_TAG : FALSE_TAG);
+                    break;
+                case LUA_TNUMBER:
+                    if (lua_isinteger(L, index)) {
+                        put_tag(INTEGER_TAG);
+                        put_raw(lua_tointeger(L, index));
+                    } else {
+                        put_tag(NUMBER_TAG);
+                        put_raw(lua_tonumber(L, index));
+                    }
+                    break;
+                case LUA_TSTRING: {
+                    std::size_t len;
+                    const char *s = lua_tolstring(L, index, &len);
+                    put_tag(STRING_TAG);
+                    put_varint(len);
+                    m_bytes.append(s, len);
+                    break;
+                }
+                case LUA_TTABLE:
+                    pack_table(L, index, depth);
+                    break;
+                default:
+                    throw lua_exception("cannot pack a value of type " +
+                                        type_to_string(lua_type(L, index)));
+            }
+        }
+
+        void pack_table(lua_State *L, int index, int depth) {
+            if (depth >= MAX_DEPTH)
+                throw lua_exception("table nesting too deep to pack");
+            if (!lua_checkstack(L, 2))
+                throw lua_exception("stack overflow while packing table");
+
+            std::uint32_t array_count = 0, hash_count = 0;
+            lua_Integer length = static_cast<lua_Integer>(lua_rawlen(L, index));
+
+            put_tag(TABLE_TAG);
+            std::size_t counts_at = m_bytes.size();
+            put_raw(array_count);
+            put_raw(hash_count);
+
+            lua_pushnil(L);
+            while (lua_next(L, index) != 0) {
+                int key = lua_gettop(L) - 1;
+                lua_Integer n;
+                if (lua_isinteger(L, key) &&
+                    (n = lua_tointeger(L, key)) >= 1 && n <= length)
+                    ++array_count;
+                else
+                    ++hash_count;
+                pack_value(L, key, depth + 1);
+                pack_value(L, key + 1, depth + 1);
+                lua_pop(L, 1);
+            }
+
+            std::memcpy(&m_bytes[counts_at], &array_count,
+                        sizeof(array_count));
+            std::memcpy(&m_bytes[counts_at + sizeof(array_count)],
+                        &hash_count, sizeof(hash_count));
+        }
+
+        static void malformed() {
+            throw lua_exception("malformed value buffer");
+        }
+
+        template <typename T>
+        static T get_raw(const char *&cursor, const char *end) {
+            T v;
+            if (static_cast<std::size_t>(end - cursor) < sizeof(T))
+                malformed();
+            std::memcpy(&v, cursor, sizeof(T));
+            cursor += sizeof(T);
+            return v;
+        }
+
+        static std::uint64_t get_varint(const char *&cursor, const char *end) {
+            std::uint64_t v = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (cursor == end)
+                    malformed();
+                unsigned char b = static_cast<unsigned char>(*cursor++);
+                v |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+                if ((b & 0x80) == 0)
+                    return v;
+            }
+            malformed();
+            return 0;
+        }
+
+        static void unpack_value(lua_State *L, const char *&cursor,
+                                 const char *end, int depth) {
+            if (cursor == end)
+                malformed();
+            switch (static_cast<unsigned char>(*cursor++)) {
+                case NIL_TAG:
+                    lua_pushnil(L);
+                    break;
+                case FALSE_TAG:
+                    lua_pushboolean(L, 0);
+                    break;
+                case TRUE_TAG:
+                    lua_pushboolean(L, 1);
+                    break;
+                case INTEGER_TAG:
+                    lua_pushinteger(L, get_raw<lua_Integer>(cursor, end));
+                    break;
+                case NUMBER_TAG:
+                    lua_pushnumber(L, get_raw<lua_Number>(cursor, end));
+                    break;
+                case STRING_TAG: {
+                    std::uint64_t len = get_varint(cursor, end);
+                    if (static_cast<std::uint64_t>(end - cursor) < len)
+                        malformed();
+                    lua_pushlstring(L, cursor, static_cast<std::size_t>(len));
+                    cursor += len;
+                    break;
+                }
+                case TABLE_TAG: {
+                    if (depth >= MAX_DEPTH || !lua_checkstack(L, 3))
+                        malformed();
+                    std::uint32_t array_count =
+                        get_raw<std::uint32_t>(cursor, end);
+                    std::uint32_t hash_count =
+                        get_raw<std::uint32_t>(cursor, end);
+                    lua_createtable(L, static_cast<int>(array_count),
+                                    static_cast<int>(hash_count));
+                    for (std::uint64_t i = 0,
+                                       n = std::uint64_t(array_count) +
+                                           hash_count;
+                         i < n; ++i) {
+                        unpack_value(L, cursor, end, depth + 1);
+                        unpack_value(L, cursor, end, depth + 1);
+                        lua_rawset(L, -3);
+                    }
+                    break;
+                }
+                default:
+                    malformed();
+            }
+        }
+    };
+
+};
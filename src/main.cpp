@@ -27,7 +27,7 @@ int main(int argc, char **argv) {
     L.load_file(filename);
 
     {
-        lualao::stack_context ctx(L);
+        lualao::stack_context ctx(L, 4, "AddStuff");
         if (auto funref = L.get_function("AddStuff", 2, 1)) {
 
             L.push(32);
@@ -53,7 +53,7 @@ int main(int argc, char **argv) {
     lualao::stack_debug_print(L);
 
     {
-        lualao::stack_context ctx(L);
+        lualao::stack_context ctx(L, 8, "Player");
 
         if (auto tableRef = L.get_table("Player")) {
 
@@ -91,5 +91,9 @@ int main(int argc, char **argv) {
 
     lualao::stack_debug_print(L);
 
+#ifdef _DEBUG
+    lualao::stack_high_water::instance().report(std::cout);
+#endif
+
     return 0;
 }
\ No newline at end of file
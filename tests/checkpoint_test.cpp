@@ -0,0 +1,46 @@
+#include <string>
+#include "lualao/lualao.hpp"
+#include "test_check.hpp"
+
+// A checkpoint over the globals of a state whose libraries are opened
+// lazily must keep loading them on demand, roll back what a request wrote
+// without losing the libraries it happened to open, and give _G its
+// metatable back once released.
+int main() {
+    lualao::state L;
+    L.open_libs_lazily();
+    lua_State *S = L;
+
+    {
+        lualao::checkpoint cp(L);
+        LUALAO_CHECK(luaL_dostring(S, "answer = 42\n"
+                                      "label = string.rep('x', 3)\n") ==
+                     LUA_OK);
+        LUALAO_CHECK(lua_getglobal(S, "label") == LUA_TSTRING);
+        lua_settop(S, 0);
+        LUALAO_CHECK(cp.pending_changes() > 0);
+
+        cp.rollback();
+        LUALAO_CHECK(cp.pending_changes() == 0);
+        LUALAO_CHECK(lua_getglobal(S, "answer") == LUA_TNIL);
+        lua_settop(S, 0);
+        LUALAO_CHECK(luaL_dostring(S, "return string.rep('y', 2)") ==
+                     LUA_OK);
+        LUALAO_CHECK(std::string(lua_tostring(S, -1)) == "yy");
+        lua_settop(S, 0);
+        LUALAO_CHECK(lua_getglobal(S, "print") == LUA_TFUNCTION);
+        lua_settop(S, 0);
+    }
+
+    // once released, _G is a plain table with its lazy loader again
+    LUALAO_CHECK(lua_gettop(S) == 0);
+    lua_pushglobaltable(S);
+    lua_pushliteral(S, "print");
+    LUALAO_CHECK(lua_rawget(S, -2) == LUA_TFUNCTION);
+    lua_pop(S, 1);
+    LUALAO_CHECK(lua_getmetatable(S, -1) != 0);
+    lua_settop(S, 0);
+    LUALAO_CHECK(luaL_dostring(S, "return os.time()") == LUA_OK);
+    lua_settop(S, 0);
+    return 0;
+}
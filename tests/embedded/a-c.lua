@@ -0,0 +1,2 @@
+-- embedded as "a-c"
+return "a-c"
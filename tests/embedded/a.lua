@@ -0,0 +1,2 @@
+-- embedded as "a"
+return "a"
@@ -0,0 +1,2 @@
+-- embedded as "a.b"
+return "a.b"
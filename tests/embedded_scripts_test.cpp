@@ -0,0 +1,29 @@
+#include <cstring>
+#include <string_view>
+
+#include "lualao/embedded_scripts.hpp"
+#include "test_check.hpp"
+
+// Generated from tests/embedded by LUALAO_EMBED_SCRIPTS.
+extern const lualao::embedded_bundle test_scripts;
+
+int main() {
+    LUALAO_CHECK(test_scripts.count == 3);
+
+    // "a" is a prefix of the other names, and '-' and '.' sort before
+    // '=', so an index sorted by "name=file" would get this wrong
+    for (const char *name : {"a", "a-c", "a.b"}) {
+        const lualao::embedded_script *script = test_scripts.find(name);
+        LUALAO_CHECK(script != nullptr);
+        LUALAO_CHECK(std::strcmp(script->name, name) == 0);
+        LUALAO_CHECK(script->size > 0);
+    }
+    for (std::size_t i = 1; i < test_scripts.count; ++i)
+        LUALAO_CHECK(std::string_view(test_scripts.scripts[i - 1].name) <
+                     std::string_view(test_scripts.scripts[i].name));
+
+    LUALAO_CHECK(test_scripts.find("b") == nullptr);
+    LUALAO_CHECK(test_scripts.find("a.") == nullptr);
+    LUALAO_CHECK(test_scripts.find("") == nullptr);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <string>
+#include "lualao/lualao.hpp"
+#include "test_check.hpp"
+
+// Two environments calling functions defined by the same chunk in the warm
+// state must each see their own _ENV, leave the chunk's shared _ENV alone
+// and still share the chunk's other upvalues.
+static const char *const WARM_CHUNK = "local count = 0\n"
+                                      "function touch(v)\n"
+                                      "  seen = v\n"
+                                      "  count = count + 1\n"
+                                      "  return count\n"
+                                      "end\n"
+                                      "function peek() return seen end\n";
+
+int main() {
+    lualao::state L;
+    L.open_libs();
+    L.load_buffer(WARM_CHUNK, "=warm");
+
+    lualao::sandbox box(L);
+    lualao::environment first = box.create();
+    lualao::environment second = box.create();
+    lua_State *S = L;
+
+    lua_getglobal(S, "touch");
+    lua_pushliteral(S, "first");
+    first.run_function(1);
+    LUALAO_CHECK(lua_tointeger(S, -1) == 1);
+    lua_settop(S, 0);
+
+    lua_getglobal(S, "touch");
+    lua_pushliteral(S, "second");
+    second.run_function(1);
+    // count is shared with the original closure
+    LUALAO_CHECK(lua_tointeger(S, -1) == 2);
+    lua_settop(S, 0);
+
+    first.push();
+    lua_getfield(S, -1, "seen");
+    LUALAO_CHECK(std::string(lua_tostring(S, -1)) == "first");
+    lua_settop(S, 0);
+
+    second.push();
+    lua_getfield(S, -1, "seen");
+    LUALAO_CHECK(std::string(lua_tostring(S, -1)) == "second");
+    lua_settop(S, 0);
+
+    // the chunk's own functions still run against the globals
+    LUALAO_CHECK(lua_getglobal(S, "seen") == LUA_TNIL);
+    lua_settop(S, 0);
+    lua_getglobal(S, "touch");
+    lua_pushliteral(S, "global");
+    LUALAO_CHECK(lua_pcall(S, 1, 1, 0) == LUA_OK);
+    LUALAO_CHECK(lua_tointeger(S, -1) == 3);
+    lua_settop(S, 0);
+    lua_getglobal(S, "peek");
+    LUALAO_CHECK(lua_pcall(S, 0, 1, 0) == LUA_OK);
+    LUALAO_CHECK(std::string(lua_tostring(S, -1)) == "global");
+    lua_settop(S, 0);
+
+    // and a request never sees what another one wrote
+    first.push();
+    lua_getfield(S, -1, "seen");
+    LUALAO_CHECK(std::string(lua_tostring(S, -1)) == "first");
+    lua_settop(S, 0);
+
+    // C functions have no _ENV to rebind
+    lua_getglobal(S, "print");
+    bool rejected = false;
+    try {
+        first.run_function(0);
+    } catch (const lualao::lua_exception &) {
+        rejected = true;
+    }
+    LUALAO_CHECK(rejected);
+    LUALAO_CHECK(lua_gettop(S) == 0);
+    return 0;
+}
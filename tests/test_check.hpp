@@ -0,0 +1,16 @@
+
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+
+// Minimal assertion for the test executables: reports the failed
+// expression and exits with a failure status.
+#define LUALAO_CHECK(expr)                                                     \
+    do {                                                                       \
+        if (!(expr)) {                                                         \
+            std::cerr << __FILE__ << ":" << __LINE__                           \
+                      << ": check failed: " #expr << std::endl;                \
+            std::exit(1);                                                      \
+        }                                                                      \
+    } while (false)